@@ -0,0 +1,72 @@
+/*
+ * arena.c — bump-pointer arenas inside the guest heap.
+ *
+ * An arena is one heap block: an avm_Arena header followed by its space.
+ * Allocating moves top forward, so it takes a few instructions and guest
+ * code can do it inline with plain loads and stores.  Nothing is freed on
+ * its own; avm_arenareset releases everything at once, which suits
+ * per-request and per-frame temporaries far better than one my_free each.
+ *
+ * When the space runs out the arena continues in an overflow chunk taken
+ * from the heap.  Chunks are linked through their first word and go back
+ * to the heap on reset, so the arena returns to its original block.
+ */
+
+#include "avm.h"
+
+/* Overflow chunk header: link to the previous chunk, padded so the space
+   after it stays aligned like a heap block */
+#define CHUNK_HEADER 16
+
+DWORD avm_newarena(avm_State *S, DWORD size) {
+    size = (size + AVM_ARENA_ALIGN - 1) & ~(AVM_ARENA_ALIGN - 1);
+    BYTE *block = my_malloc(S, sizeof(avm_Arena) + size);
+    if (!block) return 0;
+
+    DWORD arena = (DWORD)(block - S->memory);
+    avm_Arena *a = (avm_Arena *)block;
+    a->top = arena + sizeof(avm_Arena);
+    a->end = a->top + size;
+    a->chunks = 0;
+    a->size = size;
+    return arena;
+}
+
+DWORD avm_arenaalloc(avm_State *S, DWORD arena, DWORD size) {
+    avm_Arena *a = (avm_Arena *)(S->memory + arena);
+    size = (size + AVM_ARENA_ALIGN - 1) & ~(AVM_ARENA_ALIGN - 1);
+    if (size <= a->end - a->top) {
+        DWORD p = a->top;
+        a->top += size;
+        return p;
+    }
+
+    /* Continue in a new chunk at least as large as the arena itself */
+    DWORD space = size > a->size ? size : a->size;
+    BYTE *block = my_malloc(S, CHUNK_HEADER + space);
+    if (!block) return 0;
+    a = (avm_Arena *)(S->memory + arena);
+    DWORD chunk = (DWORD)(block - S->memory);
+    *(DWORD *)block = a->chunks;
+    a->chunks = chunk;
+    a->top = chunk + CHUNK_HEADER + size;
+    a->end = chunk + CHUNK_HEADER + space;
+    return chunk + CHUNK_HEADER;
+}
+
+void avm_arenareset(avm_State *S, DWORD arena) {
+    avm_Arena *a = (avm_Arena *)(S->memory + arena);
+    while (a->chunks) {
+        BYTE *block = S->memory + a->chunks;
+        a->chunks = *(DWORD *)block;
+        my_free(S, block);
+    }
+    a->top = arena + sizeof(avm_Arena);
+    a->end = a->top + a->size;
+}
+
+void avm_closearena(avm_State *S, DWORD arena) {
+    if (!arena) return;
+    avm_arenareset(S, arena);
+    my_free(S, S->memory + arena);
+}
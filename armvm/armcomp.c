@@ -256,6 +256,7 @@ BOOL is_alnum2(int a);
 void add_symbol2(LPLOCATION, LPCSTR symbol, SETPOSPROC bits);
 
 extern DWORD curfilepos;
+extern BOOL import_externals;
 
 OPCOND read_address(LPCSTR *_b, DWORD instr, SETPOSPROC setpos) {
     skip_space(_b);
@@ -554,6 +555,49 @@ DWORD assemble_bx(LPCSTR line) {
     return instr;
 }
 
+// ldrex{cond} Rt, [Rn] / strex{cond} Rd, Rt, [Rn]
+DWORD assemble_exclusive(LPCSTR line, BOOL load) {
+    DWORD instr = load ? OP_LDREX : OP_STREX;
+    BYTE Rd, Rt, Rn;
+    instr |= read_condition(&line) << 28;
+    if (!skip_space(&line))
+        return 0;
+    if (!read_register(&line, &Rd))
+        return 0;
+    instr |= Rd << 12;
+    if (!load) {
+        if (!read_register(&line, &Rt))
+            return 0;
+        instr |= Rt;
+    }
+    skip_space(&line);
+    if (!read_char(&line, '[') || !read_register(&line, &Rn) || !read_char(&line, ']'))
+        return 0;
+    instr |= Rn << 16;
+    return instr;
+}
+
+LPCSTR barriers[] = {
+    "OSHST", "OSH", "NSHST", "NSH", "ISHST", "ISH", "ST", "SY", NULL
+};
+
+static const BYTE barrier_options[] = {
+    0x2, 0x3, 0x6, 0x7, 0xa, 0xb, 0xe, 0xf
+};
+
+// dmb {option}; a missing option means SY
+DWORD assemble_dmb(LPCSTR line) {
+    skip_space(&line);
+    if (!*line)
+        return OP_DMB | 0xf;
+    for (LPCSTR *kw = barriers; *kw; kw++) {
+        if (!strcasecmp(*kw, line)) {
+            return OP_DMB | barrier_options[kw - barriers];
+        }
+    }
+    return 0;
+}
+
 DWORD assemble_trap(LPCSTR line) {
     return read_condition(&line) << 28 | 0xf << 24;
 }
@@ -607,7 +651,9 @@ DWORD assemble_branch(LPCSTR line, BOOL withlink) {
         return 0;
     }
     
-    for (int i = 0; i < MAX_SYMBOLS; i++) {
+    // Loaded programs call host functions through import slots instead,
+    // assigned at load time to whatever is left unresolved after linking
+    for (int i = 0; !import_externals && i < MAX_SYMBOLS; i++) {
         LPCSTR src = symbols[i];
         if (!strcmp(src, symbol+1)) {
             return OP_BEXT | i | read_condition(&line) << 28 | (withlink << 19);
@@ -676,6 +722,19 @@ DWORD assemble(LPCSTR line) {
             return assemble_shift(line + strlen(*kw), (DWORD)(kw - _shifts));
         }
     }
+    // before datatransfer, which would take them for LDR/STR
+    if (!strncasecmp("LDREX", line, 5)) {
+        return assemble_exclusive(line + 5, 1);
+    }
+    if (!strncasecmp("STREX", line, 5)) {
+        return assemble_exclusive(line + 5, 0);
+    }
+    if (!strcasecmp("CLREX", line)) {
+        return OP_CLREX;
+    }
+    if (!strncasecmp("DMB", line, 3)) {
+        return assemble_dmb(line + 3);
+    }
     for (LPCSTR *kw = datatransfer; *kw; kw++) {
         if (!strncasecmp(*kw, line, strlen(*kw))) {
             return assemble_datatransfer(line + strlen(*kw), (DWORD)(kw - datatransfer));
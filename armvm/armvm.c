@@ -1,7 +1,9 @@
 #include <assert.h>
 #include <memory.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include "vm.h"
 
 #define REG_SIZE sizeof(DWORD)
@@ -213,14 +215,61 @@ static void exec_dataprocessing(LPVM vm, DWORD instr) {
     REG_Rd(vm, instr) = (SetFlags ? _dp1 : _dp0)[OpCode](vm, instr, Rn, Op);
 }
 
-static inline DWORD _loadptr(LPVM vm, int offset) {
+/* Accesses to mapped regions copy only the bytes inside the region, so a
+   byte load at its last byte does not read past the host buffer; I/O
+   regions hand the access to their callbacks instead */
+static DWORD __attribute__((noinline)) _loadregion(LPVM vm, DWORD offset, DWORD size) {
+    const struct _REGION *r = vm_findregion(vm, offset);
+    if (r && r->read) {
+        return r->read(vm, r->owner, offset - r->base, (int)size);
+    }
+    DWORD avail, value = 0;
+    BYTE *p = vm_regionptr(vm, offset, AVM_MAP_READ, &avail);
+    if (!p) {
+        fprintf(stderr, "VM: load from unmapped address 0x%x\n", offset);
+        vm_halt(vm, AVM_FAULT);
+        return 0;
+    }
+    memcpy(&value, p, avail < size ? avail : size);
+    return value;
+}
+
+static void __attribute__((noinline)) _storeregion(LPVM vm, DWORD offset, DWORD value, DWORD size) {
+    const struct _REGION *r = vm_findregion(vm, offset);
+    if (r && r->write) {
+        r->write(vm, r->owner, offset - r->base, value, (int)size);
+        return;
+    }
+    DWORD avail;
+    BYTE *p = vm_regionptr(vm, offset, AVM_MAP_WRITE, &avail);
+    if (!p) {
+        fprintf(stderr, "VM: store to unmapped or read-only address 0x%x\n", offset);
+        vm_halt(vm, AVM_FAULT);
+        return;
+    }
+    memcpy(p, &value, avail < size ? avail : size);
+}
+
+/* Loads return a whole word from guest memory (callers mask it) but only
+   size bytes from a region; stores write exactly size bytes */
+static inline DWORD _loadptr(LPVM vm, DWORD offset, DWORD size) {
 //    printf("Load %08x from %08x\n", *(DWORD *)(vm->memory + offset), offset);
+    if (__builtin_expect(offset >= VM_REGION_BASE, 0))
+        return _loadregion(vm, offset, size);
     return *((DWORD *)(vm->memory + offset));
 }
 
-static inline void _storeptr(LPVM vm, int offset, DWORD value) {
+static inline void _storeptr(LPVM vm, DWORD offset, DWORD value, DWORD size) {
 //    printf("Store %08x to %08x\n", value, offset);
-    *((DWORD *)(vm->memory + offset)) = value;
+    if (__builtin_expect(offset >= VM_REGION_BASE, 0)) {
+        _storeregion(vm, offset, value, size);
+        return;
+    }
+    switch (size) {
+        case 1: *(vm->memory + offset) = (BYTE)value; break;
+        case 2: *((WORD *)(vm->memory + offset)) = (WORD)value; break;
+        default: *((DWORD *)(vm->memory + offset)) = value; break;
+    }
 }
 
 static inline DWORD _offsetptr(DWORD Rn, DWORD Offset, BOOL Up) {
@@ -241,13 +290,12 @@ static void exec_datatransfer(LPVM vm, DWORD instr) {
     DWORD Offset = Immediate ? instr & 0xfff : _calcshift(vm, instr);
     DWORD Pointer = _offsetptr(Rn, Offset, BIT_VALUE(instr, LDR_UP_BIT));
     DWORD Mask = Byte ? 0xff : 0xffffffff;
-    DWORD Existing = _loadptr(vm, Pre ? Pointer : Rn);
+    DWORD Size = Byte ? 1 : REG_SIZE;
     
     if (BIT_VALUE(instr, LDR_LOAD_BIT)) {
-        REG_Rd(vm, instr) = Existing & Mask;
+        REG_Rd(vm, instr) = _loadptr(vm, Pre ? Pointer : Rn, Size) & Mask;
     } else {
-        DWORD Val = REG_Rd(vm, instr) & Mask;
-        _storeptr(vm, Pre ? Pointer : Rn, Val | (Existing & ~Mask));
+        _storeptr(vm, Pre ? Pointer : Rn, REG_Rd(vm, instr), Size);
     }
     
     if (BIT_VALUE(instr, LDR_WRITEBACK_BIT) || !Pre) {
@@ -269,14 +317,14 @@ static void exec_ldrsb(LPVM vm, DWORD instr, DWORD Rm) {
     DWORD Pointer = _offsetptr(Rn, Offset, BIT_VALUE(instr, LDR_UP_BIT));
     DWORD Mask = Halfword ? 0xffff : 0xff;
     DWORD Sign = Halfword ? (1 << 15) : (1 << 7);
-    DWORD Existing = _loadptr(vm, Pre ? Pointer : Rn);
+    DWORD Size = Halfword ? 2 : 1;
     
     if (BIT_VALUE(instr, LDR_LOAD_BIT)) {
+        DWORD Existing = _loadptr(vm, Pre ? Pointer : Rn, Size);
         DWORD empty = (Existing & Sign) ? ~Mask : 0;
         REG_Rd(vm, instr) = (Signed ? empty : 0) | (Existing & Mask);
     } else {
-        DWORD Val = REG_Rd(vm, instr) & Mask;
-        _storeptr(vm, Pre ? Pointer : Rn, Val | (Existing & ~Mask));
+        _storeptr(vm, Pre ? Pointer : Rn, REG_Rd(vm, instr), Size);
     }
     
     if (BIT_VALUE(instr, LDR_WRITEBACK_BIT) || !Pre) {
@@ -296,23 +344,49 @@ static void exec_blockdatatransfer(LPVM vm, DWORD instr) {
         if (BIT_VALUE(instr, j)) {
             DWORD Next = Up ? (Rn + REG_SIZE) : (Rn - REG_SIZE);
             if (Load) {
-                vm->r[j] = _loadptr(vm, Pre ? Next : Rn);
+                vm->r[j] = _loadptr(vm, Pre ? Next : Rn, REG_SIZE);
                 if (j == PC_REG) {
                     vm->location = vm->r[PC_REG];
                 }
             } else {
-                _storeptr(vm, Pre ? Next : Rn, vm->r[j]);
+                _storeptr(vm, Pre ? Next : Rn, vm->r[j], REG_SIZE);
             }
             Rn = Next;
         }
     }
     if (WriteBack) {
         REG_Rn(vm, instr) = Rn;
+        if (!Up && Rn < vm->splow && ((instr >> 16) & 0xf) == SP_REG)
+            vm->splow = Rn;
     }
 }
 
 #define MASK_24BIT 0x00ffffff
 
+/*
+ * Stop the execution loop with the given status.  The loop exits because
+ * VM_HALTED is past the end of the program; vm_run() then moves the real
+ * location back from vm->resume.
+ */
+void vm_halt(LPVM vm, int status) {
+    if (vm->location == VM_HALTED)
+        return; /* first reason wins, e.g. a yield followed by a safepoint */
+    vm->status = status;
+    vm->resume = vm->location;
+    vm->location = VM_HALTED;
+}
+
+/*
+ * Safepoint poll for avm_interrupt().  Only called on backward branches and
+ * host-call boundaries, so straight-line code never pays for the atomic load.
+ */
+static inline void _safepoint(LPVM vm) {
+    if (__builtin_expect(__atomic_load_n(&vm->interrupt, __ATOMIC_ACQUIRE), 0)) {
+        __atomic_store_n(&vm->interrupt, 0, __ATOMIC_RELAXED);
+        vm_halt(vm, AVM_INTERRUPTED);
+    }
+}
+
 static void exec_branchwithlink(LPVM vm, DWORD instr) {
     BOOL  Link = BIT_VALUE(instr, 24);
     BOOL  Negative = BIT_VALUE(instr, 23);
@@ -322,6 +396,7 @@ static void exec_branchwithlink(LPVM vm, DWORD instr) {
     }
     if (Negative) {
         vm->location -= (~(Offset - 1)) & MASK_24BIT;
+        _safepoint(vm);
     } else {
         vm->location += Offset;
     }
@@ -395,9 +470,67 @@ static void exec_umul(LPVM vm, DWORD instr) {
     }
 }
 
+/* ldrex/strex are emulated with a compare-and-swap on the value ldrex saw,
+   so strex fails if any thread changed the word in between */
+static void exec_exclusive(LPVM vm, DWORD instr) {
+    DWORD addr = REG_Rn(vm, instr), avail = REG_SIZE;
+    DWORD access = BIT_VALUE(instr, LDR_LOAD_BIT) ? AVM_MAP_READ : AVM_MAP_WRITE;
+    DWORD *ptr = (DWORD *)(addr >= VM_REGION_BASE ? vm_regionptr(vm, addr, access, &avail)
+                                                  : vm->memory + addr);
+    if (!ptr || avail < REG_SIZE) {
+        fprintf(stderr, "VM: exclusive access to unmapped or read-only address 0x%x\n", addr);
+        vm_halt(vm, AVM_FAULT);
+        return;
+    }
+    if (BIT_VALUE(instr, LDR_LOAD_BIT)) {
+        vm->exaddr = addr;
+        vm->exvalue = __atomic_load_n(ptr, __ATOMIC_RELAXED);
+        vm->exclusive = 1;
+        REG_Rd(vm, instr) = vm->exvalue;
+    } else {
+        DWORD expected = vm->exvalue;
+        BOOL stored = vm->exclusive && vm->exaddr == addr &&
+            __atomic_compare_exchange_n(ptr, &expected, vm->r[instr & 0xf], 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        vm->exclusive = 0;
+        REG_Rd(vm, instr) = !stored;
+    }
+}
+
+static void exec_unconditional(LPVM vm, DWORD instr) {
+    if (instr == OP_CLREX) {
+        vm->exclusive = 0;
+    } else if ((instr & MASK_DMB) == OP_DMB) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    } else {
+        printf("Unknown instruction %08x\n", instr);
+    }
+}
+
+static DWORD _avm_dispatch(LPVM vm, DWORD call_id);
+
 static void exec_branch_external(LPVM vm, DWORD instr) {
     DWORD proc = instr & 0xffff;
-    *vm->r = vm->syscall(vm, proc);
+    if (proc & VM_IMPORT) {
+        struct _IMPORT *imp = &vm->imports[proc & ~VM_IMPORT];
+        proc = imp->call_id ? imp->call_id : vm_bindimport(vm, imp);
+        if (!proc) return;
+    }
+    /* Call registered functions directly unless the dispatcher has been
+       replaced (vm_create) or wrapped (avm_journal) */
+    if (__builtin_expect(vm->stats != NULL, 0)) {
+        avm_Stats *st = vm->stats;
+        st->hostcalls++;
+        if (st->calls && proc < st->numcalls) st->calls[proc]++;
+    }
+    if (vm->syscall == _avm_dispatch) {
+        const avm_Registry *R = vm->registry;
+        if (R && proc - 1 < R->count && R->fn[proc])
+            R->fn[proc](vm);
+    } else {
+        *vm->r = vm->syscall(vm, proc);
+    }
+    _safepoint(vm);
 }
 
 static void exec_instruction(LPVM vm) {
@@ -405,12 +538,22 @@ static void exec_instruction(LPVM vm) {
     vm->location += REG_SIZE;
     vm->r[PC_REG] = vm->location + REG_SIZE;
     DWORD cond = instr >> 28;
-    if (__builtin_expect(cond != OPCOND_AL, 0) && !_condition(vm, cond))
-        return;
+    if (__builtin_expect(cond != OPCOND_AL, 0)) {
+        if (cond == OPCOND_NV) {
+            exec_unconditional(vm, instr);
+            return;
+        }
+        if (!_condition(vm, cond))
+            return;
+    }
     if ((instr & MASK_BX) == OP_BX) {
         exec_branchandexchange(vm, instr);
         return;
     }
+    if ((instr & MASK_EX) == (OP_STREX & MASK_EX)) {
+        exec_exclusive(vm, instr);
+        return;
+    }
     if ((instr & MASK_MUL) == OP_MUL) {
         exec_mul(vm, instr);
         return;
@@ -456,25 +599,65 @@ static void exec_instruction(LPVM vm) {
     return;
 }
 
-void execute(LPVM vm, DWORD pc) {
-    memset(vm->r, 0xff, 4 * 13);
-    vm->r[LR_REG] = vm->progsize;
-    vm->location = pc;
+/* The loop used while avm_setstats is active; kept apart so the plain
+   loop carries no counters */
+static void _runcounted(LPVM vm) {
+    avm_Stats *st = vm->stats;
     while (vm->location < vm->progsize) {
+        if (st->profile) st->profile[vm->location / REG_SIZE]++;
         exec_instruction(vm);
-        assert(vm->location != 0xffffffff);
+        if (++st->instructions == st->budget && vm->location < vm->progsize)
+            vm_halt(vm, AVM_INTERRUPTED);
     }
 }
 
+int vm_run(LPVM vm) {
+    vm->status = AVM_OK;
+    vm->running++;
+    for (;;) {
+        if (__builtin_expect(vm->stats != NULL, 0)) {
+            _runcounted(vm);
+        } else {
+            while (vm->location < vm->progsize) {
+                exec_instruction(vm);
+                assert(vm->location != 0xffffffff);
+            }
+        }
+        /* Checked only once the loop exits, so fibers cost nothing per
+           instruction */
+        if (!vm->fiber || vm->location != vm->progsize + VM_FIBER_RETURN)
+            break;
+        vm_fiberreturn(vm);
+    }
+    vm->running--;
+    if (vm->status != AVM_OK) {
+        vm->location = vm->resume;
+    }
+    return vm->status;
+}
+
+int execute(LPVM vm, DWORD pc) {
+    memset(vm->r, 0xff, 4 * 13);
+    vm->r[LR_REG] = vm->progsize;
+    vm->location = pc;
+    return vm_run(vm);
+}
+
 /* ---------------------------------------------------------------------------
  * VM lifecycle - create and destroy a VM instance.
  * These live here alongside execute() rather than in the compiler, because
  * they are purely a runtime concern.
  * --------------------------------------------------------------------------- */
 
+LPVM vm_alloc(void) {
+    LPVM vm = aligned_alloc(_Alignof(struct VM), sizeof(struct VM));
+    if (vm) memset(vm, 0, sizeof(struct VM));
+    return vm;
+}
+
 LPVM vm_create(VM_SysCall syscall, DWORD stack_size, DWORD heap_size,
                BYTE *program, DWORD progsize) {
-    LPVM vm = calloc(1, sizeof(struct VM));
+    LPVM vm = vm_alloc();
     if (!vm) return NULL;
     BYTE *memory = malloc(stack_size + heap_size + progsize);
     if (!memory) { free(vm); return NULL; }
@@ -485,15 +668,252 @@ LPVM vm_create(VM_SysCall syscall, DWORD stack_size, DWORD heap_size,
     vm->progsize = progsize;
     vm->syscall = syscall;
     vm->r[SP_REG] = stack_size + progsize;
+    vm->splow = vm->r[SP_REG];
     initialize_memory_manager(vm, vm->memory + stack_size + progsize, heap_size);
     return vm;
 }
 
 void vm_shutdown(LPVM vm) {
-    free(vm->memory);
+    vm_freememory(vm);
+    vm_clearexports(vm);
+    vm_clearimports(vm);
+    vm_clearregions(vm);
     free(vm);
 }
 
+/* ---------------------------------------------------------------------------
+ * Import slots — one per distinct host function a loaded program calls.
+ * Compiled code refers to slots, not to cfuncs[] indices, so functions can
+ * be registered after loading and one program binds to whatever the host
+ * provides under each name.
+ * --------------------------------------------------------------------------- */
+
+DWORD vm_addimport(LPVM vm, LPCSTR name) {
+    for (DWORD i = 0; i < vm->numimports; i++) {
+        if (!strcmp(vm->imports[i].name, name))
+            return i;
+    }
+    if (vm->numimports >= VM_IMPORT) return VM_IMPORT;
+    struct _IMPORT *imports = realloc(vm->imports, (vm->numimports + 1) * sizeof(struct _IMPORT));
+    if (!imports) return VM_IMPORT;
+    vm->imports = imports;
+    struct _IMPORT *imp = &imports[vm->numimports];
+    imp->call_id = 0;
+    strncpy(imp->name, name, sizeof(SYMBOL) - 1);
+    imp->name[sizeof(SYMBOL) - 1] = '\0';
+    return vm->numimports++;
+}
+
+/* Resolve a slot against the registered functions; halts with AVM_FAULT
+   and returns 0 while nothing is registered under its name */
+DWORD vm_bindimport(LPVM vm, struct _IMPORT *imp) {
+    DWORD id = vm_lookupfunction(vm->registry, imp->name);
+    if (id && vm->registry->fn[id]) {
+        imp->call_id = id;
+        return id;
+    }
+    fprintf(stderr, "VM: unresolved import _%s\n", imp->name);
+    vm_halt(vm, AVM_FAULT);
+    return 0;
+}
+
+void vm_clearimports(LPVM vm) {
+    free(vm->imports);
+    vm->imports = NULL;
+    vm->numimports = 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Mapped regions — host memory reachable from guest code above
+ * VM_REGION_BASE.  Guest memory below that is untouched, so ordinary loads
+ * and stores pay one compare.  Regions get ascending addresses and are never
+ * moved, which keeps the table sorted for the binary search.  Only the
+ * topmost region's addresses are reused once it is unmapped.
+ * --------------------------------------------------------------------------- */
+
+DWORD vm_mapregion(LPVM vm, BYTE *host, DWORD size, DWORD flags,
+                   void (*release)(void *), void *owner) {
+    if (vm->parent) vm = vm->parent;
+    if (flags & AVM_MAP_WRITE) flags |= AVM_MAP_READ;
+    if (!vm->regiontop) vm->regiontop = VM_REGION_BASE;
+    DWORD base = vm->regiontop;
+    /* Keep a guard gap between regions, so overruns fault */
+    DWORD span = (size + 2 * AVM_PROGRAM_ALIGN - 1) & ~(AVM_PROGRAM_ALIGN - 1);
+    if (!size || span < size || base + span < base) return 0;
+    struct _REGION *regions = realloc(vm->regions, (vm->numregions + 1) * sizeof(struct _REGION));
+    if (!regions) return 0;
+    vm->regions = regions;
+    regions[vm->numregions++] = (struct _REGION){
+        .base = base, .size = size, .host = host, .flags = flags,
+        .release = release, .owner = owner,
+    };
+    vm->regiontop = base + span;
+    return base;
+}
+
+/* Remove the region mapped at base and run its release callback */
+BOOL vm_unmapregion(LPVM vm, DWORD base) {
+    if (vm->parent) vm = vm->parent;
+    for (DWORD i = 0; i < vm->numregions; i++) {
+        struct _REGION r = vm->regions[i];
+        if (r.base != base) continue;
+        memmove(&vm->regions[i], &vm->regions[i + 1],
+                (vm->numregions - i - 1) * sizeof(struct _REGION));
+        vm->numregions--;
+        /* The topmost region hands its address space back, so a buffer
+           mapped and unmapped per call does not use the region space up */
+        if (i == vm->numregions) vm->regiontop = r.base;
+        if (r.release) r.release(r.owner);
+        return 1;
+    }
+    return 0;
+}
+
+const struct _REGION *vm_findregion(LPVM vm, DWORD addr) {
+    if (vm->parent) vm = vm->parent;
+    DWORD lo = 0, hi = vm->numregions;
+    while (lo < hi) {
+        DWORD mid = (lo + hi) / 2;
+        const struct _REGION *r = &vm->regions[mid];
+        if (addr < r->base) {
+            hi = mid;
+        } else if (addr - r->base >= r->size) {
+            lo = mid + 1;
+        } else {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/* Host address of addr if it lies in a memory region that allows access,
+   with the number of bytes left in the region in *avail; NULL otherwise */
+BYTE *vm_regionptr(LPVM vm, DWORD addr, DWORD access, DWORD *avail) {
+    const struct _REGION *r = vm_findregion(vm, addr);
+    if (!r || !r->host || !(r->flags & access)) return NULL;
+    *avail = r->size - (addr - r->base);
+    return r->host + (addr - r->base);
+}
+
+void vm_clearregions(LPVM vm) {
+    for (DWORD i = 0; i < vm->numregions; i++) {
+        if (vm->regions[i].release)
+            vm->regions[i].release(vm->regions[i].owner);
+    }
+    free(vm->regions);
+    vm->regions = NULL;
+    vm->numregions = 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Exported symbols — open-addressing hash table keyed by fnv1a32(name).
+ * Filled once per load, so lookups by name never scan the label list.
+ * --------------------------------------------------------------------------- */
+
+static void _insertexport(struct _EXPORT *table, DWORD mask, struct _EXPORT exp) {
+    DWORD i = exp.hash & mask;
+    while (table[i].name) {
+        i = (i + 1) & mask;
+    }
+    table[i] = exp;
+}
+
+void vm_addexport(LPVM vm, LPCSTR name, DWORD position, DWORD size) {
+    if ((vm->numexports + 1) * 2 > vm->exportmask + 1 || !vm->exports) {
+        DWORD size = vm->exports ? (vm->exportmask + 1) * 2 : 16;
+        struct _EXPORT *table = calloc(size, sizeof(struct _EXPORT));
+        if (!table) return;
+        for (DWORD i = 0; vm->exports && i <= vm->exportmask; i++) {
+            if (vm->exports[i].name) {
+                _insertexport(table, size - 1, vm->exports[i]);
+            }
+        }
+        free(vm->exports);
+        vm->exports = table;
+        vm->exportmask = size - 1;
+    }
+    struct _EXPORT exp = {
+        .hash = fnv1a32(name),
+        .position = position,
+        .size = size,
+        .name = strdup(name),
+    };
+    if (!exp.name) return;
+    _insertexport(vm->exports, vm->exportmask, exp);
+    vm->numexports++;
+}
+
+const struct _EXPORT *vm_getexport(LPVM vm, LPCSTR name) {
+    if (!vm->exports) return NULL;
+    DWORD hash = fnv1a32(name);
+    for (DWORD i = hash & vm->exportmask; vm->exports[i].name; i = (i + 1) & vm->exportmask) {
+        if (vm->exports[i].hash == hash && !strcmp(vm->exports[i].name, name)) {
+            return &vm->exports[i];
+        }
+    }
+    return NULL;
+}
+
+BOOL vm_findexport(LPVM vm, LPCSTR name, DWORD *position) {
+    const struct _EXPORT *exp = vm_getexport(vm, name);
+    if (!exp) return 0;
+    *position = exp->position;
+    return 1;
+}
+
+void vm_clearexports(LPVM vm) {
+    for (DWORD i = 0; vm->exports && i <= vm->exportmask; i++) {
+        free(vm->exports[i].name);
+    }
+    free(vm->exports);
+    vm->exports = NULL;
+    vm->numexports = 0;
+    vm->exportmask = 0;
+}
+
+void vm_freememory(LPVM vm) {
+    if (vm->mapping) {
+        munmap(vm->mapping, vm->mapsize);
+        vm->mapping = NULL;
+        vm->mapsize = 0;
+    } else {
+        free(vm->memory);
+    }
+    vm->memory = NULL;
+}
+
+/* A state with growth limits reserves its whole stack and heap as address
+   space; the OS commits pages on first touch, so an idle state costs only
+   what it has used */
+BYTE *vm_allocmemory(LPVM vm, DWORD progsize) {
+    size_t size = (size_t)progsize + vm->stacksize + vm->heapsize;
+    if (!vm->heapinit) return malloc(size);
+    BYTE *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return memory == MAP_FAILED ? NULL : memory;
+}
+
+void vm_releasememory(LPVM vm, BYTE *memory, DWORD progsize) {
+    if (vm->heapinit)
+        munmap(memory, (size_t)progsize + vm->stacksize + vm->heapsize);
+    else
+        free(memory);
+}
+
+void vm_setmemory(LPVM vm, BYTE *memory, DWORD progsize) {
+    vm_freememory(vm);
+    vm->memory = memory;
+    if (vm->heapinit) {
+        vm->mapping = memory;
+        vm->mapsize = (size_t)progsize + vm->stacksize + vm->heapsize;
+    }
+    vm->progsize = progsize;
+    vm->r[SP_REG] = vm->stacksize + progsize;
+    vm->splow = vm->r[SP_REG];
+    vm_initheap(vm, memory + progsize + vm->stacksize, vm->heapsize,
+                vm->heapinit ? vm->heapinit : vm->heapsize);
+}
+
 /* ---------------------------------------------------------------------------
  * Lua-like public API  (avm_*)
  *
@@ -507,12 +927,13 @@ void vm_shutdown(LPVM vm) {
  * Internal syscall dispatcher used by avm_newstate().
  *
  * When the VM executes an external-call instruction it invokes this handler
- * with the registered function index.  We look up the matching avm_CFunction
- * in S->cfuncs and call it.
+ * with the call id.  We look up the matching avm_CFunction in S->registry
+ * and call it.
  */
 static DWORD _avm_dispatch(LPVM vm, DWORD call_id) {
-    if (call_id < AVM_MAX_CFUNCTIONS && vm->cfuncs[call_id]) {
-        vm->cfuncs[call_id](vm);
+    const avm_Registry *R = vm->registry;
+    if (R && call_id - 1 < R->count && R->fn[call_id]) {
+        R->fn[call_id](vm);
     }
     return vm->r[0];
 }
@@ -520,7 +941,7 @@ static DWORD _avm_dispatch(LPVM vm, DWORD call_id) {
 /* State management -------------------------------------------------------- */
 
 avm_State *avm_newstate(DWORD stack_size, DWORD heap_size) {
-    LPVM vm = calloc(1, sizeof(struct VM));
+    LPVM vm = vm_alloc();
     if (!vm) return NULL;
     vm->stacksize = stack_size;
     vm->heapsize = heap_size;
@@ -528,25 +949,201 @@ avm_State *avm_newstate(DWORD stack_size, DWORD heap_size) {
     return vm;
 }
 
+int avm_setlimits(avm_State *S, DWORD stacklimit, DWORD heaplimit) {
+    /* Guest addresses from VM_REGION_BASE up belong to mapped regions */
+    if (S->parent || !heaplimit ||
+        (unsigned long long)stacklimit + heaplimit >= VM_REGION_BASE / 2)
+        return -1;
+    if (!S->heapinit) S->heapinit = S->heapsize ? S->heapsize : AVM_PROGRAM_ALIGN;
+    if (S->heapinit > heaplimit) S->heapinit = heaplimit;
+    S->stacksize = stacklimit;
+    S->heapsize = heaplimit;
+    return 0;
+}
+
 void avm_close(avm_State *S) {
-    free(S->memory);
-    free(S);
+    if (S->parent) {
+        vm_closethreads(S);
+        return;
+    }
+    if (S->journal) avm_journal(S, AVM_JOURNAL_OFF, NULL);
+    vm_closethreads(S);
+    avm_closeregistry(S->registry);
+    vm_shutdown(S);
 }
 
 /* Execution --------------------------------------------------------------- */
 
-void avm_call(avm_State *S, DWORD pc) {
-    execute(S, pc);
+int avm_call(avm_State *S, DWORD pc) {
+    return execute(S, pc);
+}
+
+void avm_interrupt(avm_State *S) {
+    __atomic_store_n(&S->interrupt, 1, __ATOMIC_RELEASE);
+}
+
+void avm_setstats(avm_State *S, avm_Stats *stats) {
+    S->stats = stats;
+}
+
+/* Guest frame interrupted by a nested call, including a pending halt */
+struct _FRAME {
+    DWORD r[NUM_REGISTERS];
+    DWORD cpsr;
+    DWORD location;
+    DWORD resume;
+    int status;
+};
+
+static void _saveframe(LPVM vm, struct _FRAME *frame) {
+    memcpy(frame->r, vm->r, sizeof(frame->r));
+    frame->cpsr = vm->cpsr;
+    frame->location = vm->location;
+    frame->resume = vm->resume;
+    frame->status = vm->status;
+}
+
+/* Restore everything except r0/r1, which carry the callee's results */
+static void _restoreframe(LPVM vm, const struct _FRAME *frame) {
+    memcpy(vm->r + 2, frame->r + 2, sizeof(frame->r) - 2 * sizeof(DWORD));
+    vm->cpsr = frame->cpsr;
+    vm->location = frame->location;
+    vm->resume = frame->resume;
+    vm->status = frame->status;
+}
+
+/* Copy the stack arguments below sp and return the callee's sp */
+static DWORD _pushargs(LPVM vm, DWORD sp, int nargs, const DWORD *args) {
+    if (nargs <= 4) return sp;
+    sp = (sp - (nargs - 4) * REG_SIZE) & ~7u;
+    memcpy(vm->memory + sp, args + 4, (nargs - 4) * REG_SIZE);
+    return sp;
+}
+
+int avm_callnested(avm_State *S, DWORD pc, int nargs, const DWORD *args) {
+    assert(nargs >= 0 && nargs <= AVM_MAXARGS);
+
+    struct _FRAME frame;
+    _saveframe(S, &frame);
+
+    /* r0–r3 carry the first arguments and the rest go on the stack below
+       the caller's frame, 8-byte aligned (AAPCS); lr holds the progsize
+       sentinel, so the loop ends when the callee returns */
+    memcpy(S->r, args, (nargs < 4 ? nargs : 4) * sizeof(DWORD));
+    S->r[SP_REG] = _pushargs(S, S->r[SP_REG], nargs, args);
+    S->r[LR_REG] = S->progsize;
+    S->location = pc;
+    S->depth++;
+    int result = vm_run(S);
+    S->depth--;
+
+    _restoreframe(S, &frame);
+
+    /* An interrupt that stopped the callee must also stop the guest code
+       that called the host function, if there is any; a call made from the
+       host has no caller to stop, and the request must not outlive it */
+    if (result == AVM_INTERRUPTED && S->running) {
+        avm_interrupt(S);
+    }
+    return result;
+}
+
+int avm_callbatch(avm_State *S, DWORD fn, const DWORD *args, int nargs,
+                  DWORD count, DWORD *results) {
+    assert(nargs >= 0 && nargs <= AVM_MAXARGS);
+
+    struct _FRAME frame;
+    _saveframe(S, &frame);
+
+    /* Every call starts from the same sp and returns to the same sentinel;
+       a well-behaved callee leaves sp balanced and r4–r11 intact, so only
+       the argument registers, sp, lr and pc change between elements */
+    DWORD sp = S->r[SP_REG];
+    int regargs = nargs < 4 ? nargs : 4;
+    int result = AVM_OK;
+    S->depth++;
+    for (DWORD i = 0; i < count; i++, args += nargs) {
+        memcpy(S->r, args, regargs * sizeof(DWORD));
+        S->r[SP_REG] = _pushargs(S, sp, nargs, args);
+        S->r[LR_REG] = S->progsize;
+        S->location = fn;
+        result = vm_run(S);
+        if (result != AVM_OK)
+            break;
+        results[i] = S->r[0];
+    }
+    S->depth--;
+
+    _restoreframe(S, &frame);
+
+    /* As in avm_callnested, only guest code outside the batch is stopped */
+    if (result == AVM_INTERRUPTED && S->running) {
+        avm_interrupt(S);
+    }
+    return result;
+}
+
+DWORD avm_getfunction(avm_State *S, const char *name) {
+    DWORD position;
+    char mangled[LABEL_SIZE];
+    if (vm_findexport(S, name, &position))
+        return position;
+    /* C functions are exported with a leading underscore (_name) */
+    snprintf(mangled, sizeof(mangled), "_%s", name);
+    if (vm_findexport(S, mangled, &position))
+        return position;
+    return AVM_NOFUNCTION;
+}
+
+int avm_pcall(avm_State *S, DWORD fn, int nargs, ...) {
+    DWORD args[AVM_MAXARGS];
+    va_list ap;
+    assert(nargs >= 0 && nargs <= AVM_MAXARGS);
+    va_start(ap, nargs);
+    for (int i = 0; i < nargs; i++) {
+        args[i] = va_arg(ap, DWORD);
+    }
+    va_end(ap);
+    return avm_callnested(S, fn, nargs, args);
+}
+
+int avm_yield(avm_State *S) {
+    /* A host C frame sits between a nested guest call and its caller; it
+       cannot be parked, so a yield there just abandons the nested call */
+    if (S->depth) {
+        fprintf(stderr, "VM: cannot yield across a nested call\n");
+    }
+    /* location already points past the OP_BEXT, so resuming returns to
+       the instruction after the call */
+    vm_halt(S, AVM_YIELD);
+    return -1;
+}
+
+int avm_resume(avm_State *S, DWORD result) {
+    assert(S->status == AVM_YIELD || S->status == AVM_INTERRUPTED);
+    if (S->status == AVM_YIELD) {
+        S->r[0] = result;
+    }
+    return vm_run(S);
 }
 
 /* C function registration ------------------------------------------------- */
 
 void avm_register(avm_State *S, const char *name, avm_CFunction fn) {
-    assert(S->num_cfuncs + 1 < AVM_MAX_CFUNCTIONS);
-    DWORD idx = ++S->num_cfuncs;
-    strncpy(symbols[idx], name, sizeof(SYMBOL) - 1);
-    symbols[idx][sizeof(SYMBOL) - 1] = '\0';
-    S->cfuncs[idx] = fn;
+    avm_Registry *R = avm_getregistry(S);
+    if (!R || !avm_registryset(R, name, fn))
+        fprintf(stderr, "VM: cannot register %s\n", name);
+}
+
+int avm_bind(avm_State *S) {
+    int unresolved = 0;
+    for (DWORD i = 0; i < S->numimports; i++) {
+        struct _IMPORT *imp = &S->imports[i];
+        imp->call_id = avm_callid(S, imp->name);
+        if (imp->call_id && !S->registry->fn[imp->call_id]) imp->call_id = 0;
+        if (!imp->call_id) unresolved++;
+    }
+    return unresolved;
 }
 
 /* Stack read — ARM registers accessed 1-indexed (like lua_to*) ----------- */
@@ -568,14 +1165,21 @@ float avm_tonumber(avm_State *S, int idx) {
     return f;
 }
 
+/* Host pointer for a guest address, including mapped regions */
+static BYTE *_hostptr(avm_State *S, DWORD addr) {
+    DWORD avail;
+    if (addr < VM_REGION_BASE) return S->memory + addr;
+    return vm_regionptr(S, addr, AVM_MAP_READ, &avail);
+}
+
 const char *avm_tostring(avm_State *S, int idx) {
     assert(idx >= 1 && idx <= NUM_REGISTERS);
-    return (const char *)(S->memory + S->r[idx - 1]);
+    return (const char *)_hostptr(S, S->r[idx - 1]);
 }
 
 void *avm_topointer(avm_State *S, int idx) {
     assert(idx >= 1 && idx <= NUM_REGISTERS);
-    return (void *)(S->memory + S->r[idx - 1]);
+    return _hostptr(S, S->r[idx - 1]);
 }
 
 int avm_toboolean(avm_State *S, int idx) {
@@ -596,3 +1200,73 @@ void avm_pushnumber(avm_State *S, float n) {
 void avm_pushboolean(avm_State *S, int b) {
     S->r[0] = b ? 1 : 0;
 }
+void avm_pushpointer(avm_State *S, const void *p) {
+    const BYTE *b = p;
+    DWORD memsize = S->progsize + S->stacksize + S->heapsize;
+    if (b && (b < S->memory || b >= S->memory + memsize)) {
+        LPVM owner = S->parent ? S->parent : S;
+        for (DWORD i = 0; i < owner->numregions; i++) {
+            struct _REGION *r = &owner->regions[i];
+            if (b >= r->host && b < r->host + r->size) {
+                S->r[0] = r->base + (DWORD)(b - r->host);
+                return;
+            }
+        }
+    }
+    S->r[0] = b ? (DWORD)(b - S->memory) : 0;
+}
+
+/* Host buffers ------------------------------------------------------------ */
+
+DWORD avm_mapbuffer(avm_State *S, void *host, DWORD len, int flags) {
+    if (!host || !(flags & (AVM_MAP_READ | AVM_MAP_WRITE))) return 0;
+    return vm_mapregion(S, host, len, (DWORD)flags, NULL, NULL);
+}
+
+DWORD avm_mapio(avm_State *S, DWORD len, avm_IORead read, avm_IOWrite write, void *ud) {
+    if (!read && !write) return 0;
+    DWORD addr = vm_mapregion(S, NULL, len, 0, NULL, ud);
+    if (addr) {
+        LPVM owner = S->parent ? S->parent : S;
+        struct _REGION *r = &owner->regions[owner->numregions - 1];
+        r->read = read;
+        r->write = write;
+    }
+    return addr;
+}
+
+int avm_unmap(avm_State *S, DWORD addr) {
+    return vm_unmapregion(S, addr) ? 0 : -1;
+}
+
+/* Typed host functions ---------------------------------------------------- */
+
+void *avm_checkpointer(avm_State *S, DWORD addr) {
+    if (addr >= VM_REGION_BASE) {
+        DWORD avail;
+        BYTE *p = vm_regionptr(S, addr, AVM_MAP_READ, &avail);
+        if (p) return p;
+    }
+    if (addr >= S->progsize + S->stacksize + S->heapsize) {
+        fprintf(stderr, "VM: host argument 0x%x outside guest memory\n", addr);
+        vm_halt(S, AVM_FAULT);
+        return NULL;
+    }
+    return S->memory + addr;
+}
+
+void *avm_optpointer(avm_State *S, DWORD addr) {
+    return addr ? avm_checkpointer(S, addr) : NULL;
+}
+
+DWORD avm_argword(avm_State *S, int n) {
+    if (n < 4) return S->r[n];
+    DWORD addr = S->r[SP_REG] + (DWORD)(n - 4) * sizeof(DWORD);
+    DWORD memsize = S->progsize + S->stacksize + S->heapsize;
+    if ((addr & 3) || addr >= memsize || memsize - addr < sizeof(DWORD)) {
+        fprintf(stderr, "VM: stack argument %d at 0x%x outside guest memory\n", n, addr);
+        vm_halt(S, AVM_FAULT);
+        return 0;
+    }
+    return *(DWORD *)(S->memory + addr);
+}
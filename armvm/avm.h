@@ -50,6 +50,20 @@ extern "C" {
  */
 avm_State *avm_newstate(DWORD stack_size, DWORD heap_size);
 
+/*
+ * avm_setlimits — let the stack and heap of S grow instead of being fixed
+ * at the avm_newstate sizes.  Takes effect at the next avm_loadbuffer or
+ * avm_loadimage.
+ *
+ * Guest memory becomes reserved address space that the OS commits page by
+ * page when it is first touched, so the stack costs only its deepest use.
+ * The heap starts with an arena of the avm_newstate heap size and extends
+ * it sbrk-style when an allocation does not fit, up to heaplimit.  Returns
+ * 0, or -1 for a thread or when the limits do not fit below
+ * VM_REGION_BASE / 2.
+ */
+int avm_setlimits(avm_State *S, DWORD stacklimit, DWORD heaplimit);
+
 /*
  * avm_close — destroy a VM state and free all associated memory
  * (like lua_close).
@@ -64,14 +78,43 @@ void avm_close(avm_State *S);
  * avm_loadbuffer — compile ARM assembly source and load it into the VM
  * (like luaL_loadbuffer).
  *
- * Must be called after all avm_register() calls so that external function
- * names are resolved during compilation.
+ * Calls to functions that are not defined in the program ("bl _name") go
+ * through import slots, so host functions may be registered before or after
+ * loading; each slot binds by name on its first call (see avm_bind).
  *
  * Returns 0 on success, non-zero on compilation error.
- * On success, S->entry_point is set to the position of the _main label.
+ * On success, S->entry_point is set to the position of the _main label and
+ * S->progsize to the code size rounded up to AVM_PROGRAM_ALIGN.
  */
 int avm_loadbuffer(avm_State *S, const char *code, size_t len);
 
+/*
+ * avm_reload — replace the program of a loaded state, keeping its data.
+ *
+ * The new code is assembled into the existing program region, so the stack,
+ * the heap and every guest pointer into them stay valid.  .comm objects
+ * present in both versions keep their contents (truncated or zero-extended
+ * if the size changed); everything else in the program region comes from
+ * the new code.  Re-resolve function handles with avm_getfunction() after
+ * reloading.  Host functions stay registered.
+ *
+ * Returns 0 on success, or -1 (leaving the state untouched) on a compile
+ * error, while a run is suspended, or when the new code does not fit in
+ * the program region — avm_loadbuffer() pads it to AVM_PROGRAM_ALIGN.
+ */
+int avm_reload(avm_State *S, const char *code, size_t len);
+
+/*
+ * avm_loadimage — load an ORCA image written by armvm-compiler.
+ *
+ * The image's .globl symbols become exports (avm_getfunction) and
+ * S->entry_point is set to _main when it is exported, 0 otherwise.  The
+ * image calls host functions by the call ids its "EDU name, id" lines
+ * gave them, so register functions in that order into a fresh registry.
+ * Returns 0 on success, -1 for a malformed image or when out of memory.
+ */
+int avm_loadimage(avm_State *S, const void *image, size_t len);
+
 /* ---------------------------------------------------------------------- */
 /* Execution                                                               */
 /* ---------------------------------------------------------------------- */
@@ -81,8 +124,176 @@ int avm_loadbuffer(avm_State *S, const char *code, size_t len);
  * (like lua_call).
  *
  * After avm_loadbuffer() you typically pass S->entry_point as pc.
+ *
+ * Returns AVM_OK when the guest returned normally, AVM_YIELD when a host
+ * function suspended it with avm_yield(), AVM_INTERRUPTED when the run
+ * was stopped by avm_interrupt(), or AVM_FAULT when a typed host function
+ * was passed an invalid guest pointer or an unregistered function was
+ * called.
+ */
+int avm_call(avm_State *S, DWORD pc);
+
+/* Largest argument count accepted by avm_callnested/avm_pcall/avm_callbatch */
+#define AVM_MAXARGS 16
+
+/* Returned by avm_getfunction for unknown names */
+#define AVM_NOFUNCTION 0xffffffff
+
+/*
+ * avm_getfunction — look up an exported (.globl) guest function by name.
+ *
+ * name is tried as given and then with the leading underscore C compilers
+ * add, so both "update" and "_update" find "_update".  The lookup uses a
+ * hash index built by avm_loadbuffer(); resolve handles once and reuse them.
+ * Returns the function's program offset, or AVM_NOFUNCTION.
+ */
+DWORD avm_getfunction(avm_State *S, const char *name);
+
+/*
+ * avm_pcall — call a guest function with nargs DWORD arguments.
+ *
+ * Arguments are marshalled per AAPCS: the first four in r0–r3, the rest on
+ * the stack.  Results are left in r0/r1 (avm_tointeger(S, 1) / (S, 2)).
+ * Works both from the host and from inside an avm_CFunction; see
+ * avm_callnested for what is preserved.  Returns an avm_call status.
+ */
+int avm_pcall(avm_State *S, DWORD fn, int nargs, ...);
+
+/*
+ * avm_callnested — call the guest function at pc from inside an
+ * avm_CFunction and return to the interrupted guest frame afterwards.
+ *
+ * The first four arguments are passed in r0–r3 and the remainder on the
+ * stack.  The callee runs on the caller's stack below its current sp and
+ * returns with "bx lr" as usual.
+ * All registers and the CPSR of the interrupted frame are restored except
+ * r0/r1, which hold the callee's results (they are caller-saved under the
+ * ARM calling convention anyway) — read them with avm_tointeger(S, 1).
+ *
+ * Returns AVM_OK, or the status that stopped the callee.  A nested call
+ * cannot be suspended: if the callee yields it is abandoned, and if it is
+ * interrupted the interrupt is re-raised so the outer run stops as well.
  */
-void avm_call(avm_State *S, DWORD pc);
+int avm_callnested(avm_State *S, DWORD pc, int nargs, const DWORD *args);
+
+/*
+ * avm_callbatch — call the guest function fn once per argument tuple.
+ *
+ * args holds count tuples of nargs DWORDs each, back to back; r0 of call i
+ * is stored in results[i].  The frame is saved and restored once for the
+ * whole batch, so per-element overhead is just loading the arguments.
+ * Like avm_callnested it may be used from the host or from inside an
+ * avm_CFunction.  Stops at the first call that does not return AVM_OK and
+ * returns its status; results of the remaining elements are left untouched.
+ */
+int avm_callbatch(avm_State *S, DWORD fn, const DWORD *args, int nargs,
+                  DWORD count, DWORD *results);
+
+/*
+ * avm_yield — suspend the guest from inside an avm_CFunction
+ * (like lua_yield).  Use as "return avm_yield(S);".
+ *
+ * The running avm_call()/avm_resume() returns AVM_YIELD immediately and the
+ * guest stays parked right after its "bl _name".  The thread is free to run
+ * other states until the host work finishes.
+ */
+int avm_yield(avm_State *S);
+
+/*
+ * avm_resume — continue a state suspended by avm_yield() or
+ * avm_interrupt() (like lua_resume).
+ *
+ * For a yield, result becomes the host function's return value in r0.  May
+ * be called from a different thread than the one that yielded.  Returns the
+ * same status codes as avm_call().
+ */
+int avm_resume(avm_State *S, DWORD result);
+
+/*
+ * avm_interrupt — ask a running (or the next) avm_call to stop.
+ *
+ * Safe to call from any thread, e.g. a watchdog.  The interpreter only
+ * checks the request at backward branches and after host calls, so a
+ * runaway loop stops within one iteration while straight-line code pays
+ * nothing.  The request is consumed by the run it stops.
+ */
+void avm_interrupt(avm_State *S);
+
+/*
+ * avm_setstats — count instructions and host calls of S into stats, or
+ * stop counting when stats is NULL.
+ *
+ * Runs switch to a separate counting loop while stats is set, so a state
+ * without it pays nothing.  Set stats->budget to stop a run with
+ * AVM_INTERRUPTED (resumable with avm_resume) once stats->instructions
+ * reaches it, e.g. budget = instructions + n for at most n more.  Threads
+ * created by avm_newthread do not inherit the counters.
+ */
+void avm_setstats(avm_State *S, avm_Stats *stats);
+
+/*
+ * avm_memstats — fill out with the heap usage of S and the deepest its
+ * stack has been, to size avm_newstate's stack_size and heap_size.
+ *
+ * The heap figures come from counters the allocator keeps anyway; only the
+ * largest free block takes a walk, of one free list.  The stack is sampled
+ * when push/stmdb writes SP back, so space reserved with "sub sp" alone is
+ * not seen.  For a guest thread the stack figures are its own stack's.
+ */
+void avm_memstats(avm_State *S, avm_MemStats *out);
+
+/* ---------------------------------------------------------------------- */
+/* Snapshots                                                               */
+/* ---------------------------------------------------------------------- */
+
+/*
+ * avm_dump — write the complete state (registers, CPSR, entry point,
+ * registered-function names, exported symbols and the guest memory image
+ * including the heap free list) to the file at path.  All-zero pages are stored as holes.
+ *
+ * Returns 0 on success, non-zero on I/O error.
+ */
+int avm_dump(avm_State *S, const char *path);
+
+/*
+ * avm_undump — restore a state written by avm_dump (like lua_undump).
+ *
+ * The snapshot is mapped copy-on-write rather than read, so restoring is
+ * independent of the image size.  Host function pointers cannot be saved:
+ * call avm_register() again for every name before running code; each name
+ * is bound to the index the compiled code was assembled against.
+ *
+ * Returns NULL if the file is missing or not a valid snapshot.
+ */
+avm_State *avm_undump(const char *path);
+
+/* ---------------------------------------------------------------------- */
+/* Host-call journal (record/replay)                                       */
+/* ---------------------------------------------------------------------- */
+
+#define AVM_JOURNAL_OFF    0
+#define AVM_JOURNAL_RECORD 1
+#define AVM_JOURNAL_REPLAY 2
+
+/*
+ * avm_journal — record or replay every host call made by the guest.
+ *
+ * AVM_JOURNAL_RECORD writes the call index, r0–r3, the results in r0/r1
+ * and all guest memory the host function changed to the file at path.
+ * Calls the host function itself makes (ring requests, nested guest code)
+ * are part of that entry and are not journaled on their own.
+ * AVM_JOURNAL_REPLAY reads such a file and reproduces each call from it
+ * without invoking the host, so a run can be repeated where the host
+ * subsystems do not exist.  AVM_JOURNAL_OFF closes the current journal.
+ *
+ * Start recording and replaying after avm_loadbuffer() with the same
+ * program and memory sizes.  Recording compares guest memory before and
+ * after every call and is meant for investigations, not production.
+ *
+ * Returns 0 on success, non-zero if the file cannot be opened or is not a
+ * journal for a state of this size.
+ */
+int avm_journal(avm_State *S, int mode, const char *path);
 
 /* ---------------------------------------------------------------------- */
 /* C function registration                                                 */
@@ -92,11 +303,427 @@ void avm_call(avm_State *S, DWORD pc);
  * avm_register — register a C function under a name so that ARM assembly
  * can call it with "bl _<name>" (like lua_register).
  *
- * Must be called before avm_loadbuffer() so the assembler can resolve the
- * symbol.  name must not include a leading underscore.
+ * May be called before or after avm_loadbuffer().  name must not include a
+ * leading underscore.  Registering a name that is already known replaces
+ * its function but keeps its index, so bound calls switch to the new one.
+ * The function goes into S's registry, which other states may share.
  */
 void avm_register(avm_State *S, const char *name, avm_CFunction fn);
 
+/*
+ * avm_newregistry / avm_closeregistry — create a host-function registry
+ * with one reference, and drop a reference.  A registry has no size limit.
+ *
+ * avm_setregistry — make S use R (taking a reference) instead of its own
+ * table, so many states share one set of functions.  Import slots bind
+ * again by name.  Register into a shared registry before running states
+ * on other threads.
+ *
+ * avm_getregistry — S's registry, created on first use; NULL only when out
+ * of memory.  avm_registryset registers into R directly and returns the
+ * call id, 0 when out of memory.
+ */
+avm_Registry *avm_newregistry(void);
+void avm_closeregistry(avm_Registry *R);
+void avm_setregistry(avm_State *S, avm_Registry *R);
+avm_Registry *avm_getregistry(avm_State *S);
+DWORD avm_registryset(avm_Registry *R, const char *name, avm_CFunction fn);
+
+/*
+ * avm_openlibs — register the standard host library (hostlib.c) in S:
+ * puts, putchar, print_int, print_string, strlen, strcmp, memcpy, memset,
+ * malloc, free, arena_new, arena_alloc, arena_reset, arena_free, realloc
+ * and calloc.  In a fresh registry they get call ids 1-16 in that order,
+ * for ORCA images that declare them with EDU (see avm_loadimage).
+ */
+void avm_openlibs(avm_State *S);
+
+/*
+ * avm_bind — bind every import slot of the loaded program now instead of on
+ * first call.  Returns the number of names with no registered function;
+ * calling one of those stops the run with AVM_FAULT.
+ */
+int avm_bind(avm_State *S);
+
+/*
+ * avm_callid — index of a registered function, as used by "bl _name" and
+ * by avm_RingSQE.func.  Returns 0 if name is not registered.
+ */
+DWORD avm_callid(avm_State *S, const char *name);
+
+/* ---------------------------------------------------------------------- */
+/* Submission/completion ring for batched host calls                      */
+/*                                                                         */
+/* The ring lives in guest memory; every field is a DWORD and addresses   */
+/* are guest offsets.  The guest writes requests at                       */
+/* sqes[sq_tail & (entries-1)] and increments sq_tail; it reads results   */
+/* at cqes[cq_head & (entries-1)] while cq_head != cq_tail and increments */
+/* cq_head.  The host advances sq_head and cq_tail.                       */
+/* ---------------------------------------------------------------------- */
+
+typedef struct {
+    DWORD entries;   /* number of slots, a power of two */
+    DWORD sqes;      /* guest address of avm_RingSQE[entries] */
+    DWORD cqes;      /* guest address of avm_RingCQE[entries] */
+    DWORD sq_head;   /* next request the host will consume */
+    DWORD sq_tail;   /* next free request slot (guest) */
+    DWORD cq_head;   /* next completion the guest will consume */
+    DWORD cq_tail;   /* next free completion slot (host) */
+    DWORD reserved;
+} avm_Ring;
+
+typedef struct {
+    DWORD func;      /* avm_callid() of the host function */
+    DWORD args[4];   /* r0–r3 for the call */
+    DWORD user_data; /* copied to the completion */
+    DWORD reserved[2];
+} avm_RingSQE;
+
+typedef struct {
+    DWORD user_data;
+    DWORD result;    /* r0 returned by the host function */
+} avm_RingCQE;
+
+/*
+ * avm_newring — allocate a ring with entries slots (a power of two) in the
+ * guest heap.  Returns its guest address, or 0 on failure.  Release it with
+ * my_free like any other heap block.
+ */
+DWORD avm_newring(avm_State *S, DWORD entries);
+
+/*
+ * avm_drainring — run every pending request of the ring at guest address
+ * ring and post its completion.  Stops early when the completion queue is
+ * full.  Returns the number of requests processed, or -1 and halts the run
+ * with AVM_FAULT if the header, entries (a power of two) or either queue
+ * does not lie inside guest memory.
+ *
+ * Call it between runs (or while the guest is suspended), or let the guest
+ * call it in one transition through avm_ringsubmit.  Host functions
+ * reached through a ring must not yield.
+ */
+int avm_drainring(avm_State *S, DWORD ring);
+
+/*
+ * avm_ringsubmit — avm_CFunction wrapper around avm_drainring for guests:
+ *
+ *   avm_register(S, "ring_submit", avm_ringsubmit);
+ *
+ *   ldr r0, <ring>
+ *   bl  _ring_submit      @ r0 = number of requests processed
+ */
+int avm_ringsubmit(avm_State *S);
+
+/* ---------------------------------------------------------------------- */
+/* Bump-pointer arenas                                                     */
+/*                                                                         */
+/* An arena lives in the guest heap; addresses are guest offsets.  Guest  */
+/* code can allocate size bytes (a multiple of AVM_ARENA_ALIGN) inline:   */
+/*                                                                         */
+/*   ldr   r1, [r0]         @ r0 = arena, r1 = top = the new block        */
+/*   ldr   r3, [r0, #4]     @ end                                         */
+/*   add   r2, r1, #size                                                  */
+/*   cmp   r2, r3                                                         */
+/*   strls r2, [r0]                                                       */
+/*   bhi   slow             @ full: call _arena_alloc instead             */
+/*                                                                         */
+/* Arenas are not locked: give each guest thread its own.                 */
+/* ---------------------------------------------------------------------- */
+
+/* Arena allocations are rounded up to this many bytes */
+#define AVM_ARENA_ALIGN 8
+
+typedef struct {
+    DWORD top;       /* next free byte */
+    DWORD end;       /* end of the current chunk's space */
+    DWORD chunks;    /* newest overflow chunk, 0 for none */
+    DWORD size;      /* bytes of space in the arena's own block */
+} avm_Arena;
+
+/*
+ * avm_newarena — allocate an arena with size bytes of space in the guest
+ * heap.  Returns its guest address, or 0 when the heap is exhausted.
+ */
+DWORD avm_newarena(avm_State *S, DWORD size);
+
+/*
+ * avm_arenaalloc — size bytes from the arena, aligned to AVM_ARENA_ALIGN.
+ * When the space is used up the arena continues in an overflow chunk taken
+ * from the heap.  Returns a guest address, or 0 when the heap is exhausted.
+ */
+DWORD avm_arenaalloc(avm_State *S, DWORD arena, DWORD size);
+
+/*
+ * avm_arenareset — release every allocation of the arena at once and give
+ * its overflow chunks back to the heap.  Call it at the end of a request
+ * or frame.
+ */
+void avm_arenareset(avm_State *S, DWORD arena);
+
+/* avm_closearena — reset the arena and free its block */
+void avm_closearena(avm_State *S, DWORD arena);
+
+/* ---------------------------------------------------------------------- */
+/* Guest threads                                                           */
+/*                                                                         */
+/* Threads of one state share its memory and functions but have their    */
+/* own registers and a stack allocated from the guest heap.  Guest code   */
+/* synchronises with ldrex/strex/clrex/dmb and the futex functions.       */
+/* ---------------------------------------------------------------------- */
+
+/* Threads one state can have spawned with avm_threadspawn at a time */
+#define AVM_MAX_THREADS 64
+
+/* Stack size of threads started by avm_threadspawn */
+#define AVM_THREAD_STACK (16 * 1024)
+
+/*
+ * avm_newthread — create a guest thread of S (like lua_newthread) with a
+ * stacksize-byte stack taken from S's heap.  Run guest code on it from any
+ * host thread with avm_pcall/avm_callbatch; release it with avm_close.
+ * It shares S's function registry.  Returns NULL when
+ * the heap is exhausted.
+ *
+ * Once a state has threads, my_malloc/my_free take a lock.  Do not reload,
+ * journal or close S while its threads are running.
+ */
+avm_State *avm_newthread(avm_State *S, DWORD stacksize);
+
+/*
+ * avm_threadspawn / avm_threadjoin — avm_CFunctions that let guests start
+ * threads on host pthreads:
+ *
+ *   avm_register(S, "thread_spawn", avm_threadspawn);
+ *   avm_register(S, "thread_join",  avm_threadjoin);
+ *
+ *   adr r0, _worker            @ r0 = function, r1 = its argument
+ *   bl  _thread_spawn          @ r0 = thread id, 0 on failure
+ *   ...
+ *   bl  _thread_join           @ r0 = thread id → r0 returned by _worker
+ *
+ * avm_close joins threads that were never joined.
+ */
+int avm_threadspawn(avm_State *S);
+int avm_threadjoin(avm_State *S);
+
+/* Results of futex_wait */
+#define AVM_FUTEX_WOKEN    0
+#define AVM_FUTEX_CHANGED  1
+#define AVM_FUTEX_TIMEDOUT 2
+
+/*
+ * avm_futexwait / avm_futexwake — avm_CFunctions for blocking on a guest
+ * word, like Linux futex(2):
+ *
+ *   futex_wait(addr, expected, timeout_ms)   sleeps while *addr == expected
+ *       → AVM_FUTEX_WOKEN, _CHANGED or _TIMEDOUT; timeout_ms 0 waits forever
+ *   futex_wake(addr, count)                  wakes up to count waiters
+ *       → number woken
+ *
+ * addr must be a word-aligned address in guest or mapped memory; anything
+ * else halts the run with AVM_FAULT.  A waiting guest blocks its host
+ * thread and does not see avm_interrupt.
+ */
+int avm_futexwait(avm_State *S);
+int avm_futexwake(avm_State *S);
+
+/* ---------------------------------------------------------------------- */
+/* Fibers                                                                  */
+/*                                                                         */
+/* Coroutines inside one state: each has its own registers and a small    */
+/* stack from the guest heap, and switching is a register-file swap that  */
+/* never leaves the interpreter loop.  A fiber runs until it yields back  */
+/* to whoever resumed it, or returns from its entry function.             */
+/* ---------------------------------------------------------------------- */
+
+#define AVM_FIBER_SUSPENDED 0   /* created, or stopped in fiber_yield */
+#define AVM_FIBER_RUNNING   1
+#define AVM_FIBER_NORMAL    2   /* resumed another fiber and waits for it */
+#define AVM_FIBER_DEAD      3   /* its entry function returned */
+
+/* Context record at the start of a fiber's heap block; guests may read
+   status (offset 76) to see whether a fiber has finished */
+typedef struct {
+    DWORD r[NUM_REGISTERS];
+    DWORD cpsr;
+    DWORD location;  /* where the fiber continues */
+    DWORD resumer;   /* record to switch back to on yield or return */
+    DWORD status;    /* AVM_FIBER_* */
+} avm_Fiber;
+
+/*
+ * avm_newfiber — create a suspended fiber that will call fn(arg) on a
+ * stacksize-byte stack.  The record and the stack are one my_malloc block
+ * at the returned guest address; my_free it once the fiber is dead.
+ * Returns 0 when the heap is exhausted.
+ */
+DWORD avm_newfiber(avm_State *S, DWORD fn, DWORD arg, DWORD stacksize);
+
+/*
+ * avm_runfiber — resume a fiber from the host, passing value, and run until
+ * it yields or returns.  r0 then holds the yielded or returned value.
+ * Returns the run status, or -1 if the fiber is not suspended or does not
+ * lie inside guest memory.  A fiber
+ * stopped by avm_yield/avm_interrupt is continued with avm_resume.
+ */
+int avm_runfiber(avm_State *S, DWORD fiber, DWORD value);
+
+/*
+ * avm_fiberresume / avm_fiberyield — avm_CFunctions for switching fibers
+ * from guest code:
+ *
+ *   avm_register(S, "fiber_resume", avm_fiberresume);
+ *   avm_register(S, "fiber_yield",  avm_fiberyield);
+ *
+ *   bl _fiber_resume     @ r0 = fiber, r1 = value → r0 = value it yielded
+ *                        @ or returned, 0 if it was not suspended
+ *   bl _fiber_yield      @ r0 = value → r0 = value of the next resume
+ *
+ * A fiber address (or a record's resumer) outside guest memory halts the
+ * run with AVM_FAULT.  Only r0 crosses a switch; every other register
+ * belongs to its fiber.
+ * Code addresses saved in fibers do not survive avm_reload.
+ */
+int avm_fiberresume(avm_State *S);
+int avm_fiberyield(avm_State *S);
+
+/* ---------------------------------------------------------------------- */
+/* Host buffers                                                            */
+/*                                                                         */
+/* Host memory can be mapped into a state at VM_REGION_BASE and above, so */
+/* guest code works on it in place instead of on a my_malloc copy.        */
+/* ---------------------------------------------------------------------- */
+
+/*
+ * avm_mapbuffer — make len bytes at host visible to guest code and return
+ * their guest address, 0 on failure.  flags is AVM_MAP_READ or
+ * AVM_MAP_WRITE (read-write); a guest store to a read-only buffer halts the
+ * run with AVM_FAULT.  The host still owns the buffer and must keep it
+ * alive until avm_unmap or avm_close.  avm_topointer and avm_pushpointer
+ * translate addresses inside mapped buffers.
+ *
+ * avm_unmap — remove the mapping at addr (as returned by avm_mapbuffer or
+ * avm_mapchannel).  Returns 0, or -1 if nothing is mapped there.  Unmapping
+ * the most recent mapping frees its addresses for the next one, so a buffer
+ * can be mapped and unmapped per call.
+ */
+DWORD avm_mapbuffer(avm_State *S, void *host, DWORD len, int flags);
+int   avm_unmap(avm_State *S, DWORD addr);
+
+/*
+ * avm_mapio — map a len-byte window of device registers whose loads call
+ * read(S, ud, offset, size) and whose stores call write(S, ud, offset,
+ * value, size), with size 1, 2 or 4.  Either callback may be NULL, making
+ * that kind of access fault.  Returns the guest address, 0 on failure.
+ * Each access costs one C call, no OP_BEXT transition or register setup;
+ * ldrex/strex and avm_topointer do not work on I/O windows.
+ */
+DWORD avm_mapio(avm_State *S, DWORD len, avm_IORead read, avm_IOWrite write, void *ud);
+
+/* ---------------------------------------------------------------------- */
+/* Channels                                                                */
+/*                                                                         */
+/* A channel is host memory mapped into the address space of every state  */
+/* that uses it, at or above VM_REGION_BASE.  Producers write messages    */
+/* into slots in place and consumers read them in place; sending and      */
+/* receiving only move indices.  Many producers, one consumer.            */
+/* ---------------------------------------------------------------------- */
+
+/* Channel header; slots[slots][slotsize] follow it */
+typedef struct {
+    DWORD slots;      /* number of slots, a power of two */
+    DWORD slotsize;   /* bytes per slot, a multiple of 4 */
+    DWORD head;       /* next message the consumer reads */
+    DWORD tail;       /* messages published so far */
+    DWORD reserve;    /* slots claimed by producers so far */
+    DWORD reserved[3];
+} avm_Channel;
+
+/*
+ * avm_newchannel — allocate a channel of slots (a power of two) messages of
+ * up to slotsize bytes each.  Returns NULL on bad arguments or no memory.
+ *
+ * avm_mapchannel — map ch into S and return its guest address, 0 on
+ * failure.  The mapping keeps ch alive until S is closed.
+ *
+ * avm_closechannel — drop the reference returned by avm_newchannel.
+ */
+avm_Channel *avm_newchannel(DWORD slots, DWORD slotsize);
+DWORD avm_mapchannel(avm_State *S, avm_Channel *ch);
+void avm_closechannel(avm_Channel *ch);
+
+/*
+ * avm_chanclaim / avm_chansend / avm_chanrecv / avm_chanrelease —
+ * avm_CFunctions for guest code; ch is the address from avm_mapchannel:
+ *
+ *   chan_claim(ch)        → address of a free slot to fill, 0 if full
+ *   chan_send(ch, slot)   publishes a claimed slot, 0 or -1 if slot is not
+ *                         a claimed, unsent slot; messages become visible
+ *                         in claim order, so a slot sent early waits for
+ *                         the earlier claims without blocking the sender
+ *   chan_recv(ch)         → address of the oldest message, 0 if empty
+ *   chan_release(ch)      frees the message chan_recv returned
+ */
+int avm_chanclaim(avm_State *S);
+int avm_chansend(avm_State *S);
+int avm_chanrecv(avm_State *S);
+int avm_chanrelease(avm_State *S);
+
+/* ---------------------------------------------------------------------- */
+/* Worker processes                                                        */
+/*                                                                         */
+/* A pool forks worker processes that run requests against one loaded     */
+/* module.  The module's memory image is sealed into a memfd once and     */
+/* mapped copy-on-write by every worker, so code pages are shared and a   */
+/* crashing host function takes down only its own worker.                 */
+/* ---------------------------------------------------------------------- */
+
+/* Arguments an avm_Request can carry */
+#define AVM_POOL_ARGS 4
+
+typedef struct {
+    DWORD id;                    /* copied to the reply */
+    DWORD nargs;                 /* at most AVM_POOL_ARGS */
+    DWORD args[AVM_POOL_ARGS];
+    SYMBOL function;             /* exported guest function to call */
+} avm_Request;
+
+typedef struct {
+    DWORD id;
+    int status;      /* AVM_* of the call; AVM_FAULT if the worker died
+                        or timed out, -1 for an unknown function */
+    DWORD result;    /* r0 */
+} avm_Reply;
+
+typedef struct avm_Pool avm_Pool;
+
+/*
+ * avm_newpool — fork `workers` processes that each serve module, a state
+ * with a loaded program and its host functions registered.  Workers start
+ * from module's memory as it is now; setup, if not NULL, runs in every worker
+ * before its first request.  Returns NULL on failure.  Keep module open
+ * until avm_closepool; do not use it with threads or mapped regions.
+ */
+avm_Pool *avm_newpool(avm_State *module, DWORD workers, void (*setup)(avm_State *S));
+
+/*
+ * avm_poolrun — run count requests on the pool's workers and store the
+ * reply of reqs[i] in replies[i].  Dead workers are replaced.  Returns 0,
+ * or -1 if a worker could not be started.
+ */
+int avm_poolrun(avm_Pool *P, const avm_Request *reqs, avm_Reply *replies, DWORD count);
+
+/*
+ * avm_setpooltimeout — limit each request to ms milliseconds (0, the
+ * default, waits forever).  A worker that overruns is killed and replaced,
+ * and its request is answered with AVM_FAULT like a crash.
+ */
+void avm_setpooltimeout(avm_Pool *P, DWORD ms);
+
+/* avm_closepool — stop the workers, killing any still busy, and release
+   the pool */
+void avm_closepool(avm_Pool *P);
+
 /* ---------------------------------------------------------------------- */
 /* Reading ARM registers (1-indexed, like lua_to*)                        */
 /*                                                                         */
@@ -120,6 +747,95 @@ int          avm_toboolean (avm_State *S, int idx);
 void avm_pushinteger(avm_State *S, int n);
 void avm_pushnumber (avm_State *S, float n);
 void avm_pushboolean(avm_State *S, int b);
+void avm_pushpointer(avm_State *S, const void *p); /* host pointer → guest address */
+
+/* ---------------------------------------------------------------------- */
+/* Typed host functions                                                    */
+/*                                                                         */
+/* AVM_THUNKn(ret, fn, a1, …, an) defines fn_thunk, an avm_CFunction that */
+/* calls the plain C function fn with its arguments taken straight from   */
+/* r0–r3 and the guest stack, so hosts need no hand-written avm_to*       */
+/* wrapper.  The type letters form the signature, "i:pi" below:           */
+/*                                                                         */
+/*   v  void (return only)       p  void *        (guest pointer)         */
+/*   i  int                      s  const char *  (guest pointer)         */
+/*   u  unsigned int             f  float         (soft-float, core reg)  */
+/*                                                                         */
+/*   static int sum(void *buf, int n) { … }                                */
+/*   AVM_THUNK2(i, sum, p, i)                                              */
+/*   avm_register(S, "sum", sum_thunk);                                    */
+/*                                                                         */
+/* Arguments are bounds-checked once on entry: a pointer or stack word    */
+/* outside guest memory stops the run with AVM_FAULT before fn is called, */
+/* and a 0 pointer arrives as NULL.                                        */
+/* ---------------------------------------------------------------------- */
+
+/*
+ * avm_checkpointer — host pointer for guest address addr, or NULL after
+ * halting the run with AVM_FAULT when addr lies outside guest memory.
+ */
+void *avm_checkpointer(avm_State *S, DWORD addr);
+
+/* avm_optpointer — like avm_checkpointer, but guest address 0 is NULL */
+void *avm_optpointer(avm_State *S, DWORD addr);
+
+/*
+ * avm_argword — argument word n (0-based): r0–r3, then the caller's stack.
+ * A stack word outside guest memory halts the run with AVM_FAULT and
+ * reads as 0.
+ */
+DWORD avm_argword(avm_State *S, int n);
+
+#define AVM_ARGWORD(S, n) ((n) < 4 ? (S)->r[n] : avm_argword(S, n))
+
+#define AVM_TYPE_i int
+#define AVM_TYPE_u unsigned int
+#define AVM_TYPE_f float
+#define AVM_TYPE_p void *
+#define AVM_TYPE_s const char *
+
+#define AVM_ARG_i(S, n) ((int)AVM_ARGWORD(S, n))
+#define AVM_ARG_u(S, n) ((unsigned int)AVM_ARGWORD(S, n))
+#define AVM_ARG_f(S, n) (((union { DWORD w; float f; }){ AVM_ARGWORD(S, n) }).f)
+#define AVM_ARG_p(S, n) avm_optpointer(S, AVM_ARGWORD(S, n))
+#define AVM_ARG_s(S, n) ((const char *)avm_optpointer(S, AVM_ARGWORD(S, n)))
+
+#define AVM_RET_v(S, call) ((call), 0)
+#define AVM_RET_i(S, call) (avm_pushinteger(S, (call)), 1)
+#define AVM_RET_u(S, call) ((S)->r[0] = (DWORD)(call), 1)
+#define AVM_RET_f(S, call) (avm_pushnumber(S, (call)), 1)
+#define AVM_RET_p(S, call) (avm_pushpointer(S, (call)), 1)
+
+#define AVM_THUNK_BEGIN(fn) static int fn##_thunk(avm_State *S) {
+#define AVM_THUNK_ARG(t, n) AVM_TYPE_##t arg##n = AVM_ARG_##t(S, n);
+#define AVM_THUNK_CALL(r, call) \
+    if (S->location == VM_HALTED) return 0; \
+    return AVM_RET_##r(S, call); }
+
+#define AVM_THUNK0(r, fn) \
+    AVM_THUNK_BEGIN(fn) (void)S; \
+    return AVM_RET_##r(S, fn()); }
+#define AVM_THUNK1(r, fn, a) \
+    AVM_THUNK_BEGIN(fn) AVM_THUNK_ARG(a, 0) \
+    AVM_THUNK_CALL(r, fn(arg0))
+#define AVM_THUNK2(r, fn, a, b) \
+    AVM_THUNK_BEGIN(fn) AVM_THUNK_ARG(a, 0) AVM_THUNK_ARG(b, 1) \
+    AVM_THUNK_CALL(r, fn(arg0, arg1))
+#define AVM_THUNK3(r, fn, a, b, c) \
+    AVM_THUNK_BEGIN(fn) AVM_THUNK_ARG(a, 0) AVM_THUNK_ARG(b, 1) AVM_THUNK_ARG(c, 2) \
+    AVM_THUNK_CALL(r, fn(arg0, arg1, arg2))
+#define AVM_THUNK4(r, fn, a, b, c, d) \
+    AVM_THUNK_BEGIN(fn) AVM_THUNK_ARG(a, 0) AVM_THUNK_ARG(b, 1) AVM_THUNK_ARG(c, 2) \
+    AVM_THUNK_ARG(d, 3) \
+    AVM_THUNK_CALL(r, fn(arg0, arg1, arg2, arg3))
+#define AVM_THUNK5(r, fn, a, b, c, d, e) \
+    AVM_THUNK_BEGIN(fn) AVM_THUNK_ARG(a, 0) AVM_THUNK_ARG(b, 1) AVM_THUNK_ARG(c, 2) \
+    AVM_THUNK_ARG(d, 3) AVM_THUNK_ARG(e, 4) \
+    AVM_THUNK_CALL(r, fn(arg0, arg1, arg2, arg3, arg4))
+#define AVM_THUNK6(r, fn, a, b, c, d, e, f) \
+    AVM_THUNK_BEGIN(fn) AVM_THUNK_ARG(a, 0) AVM_THUNK_ARG(b, 1) AVM_THUNK_ARG(c, 2) \
+    AVM_THUNK_ARG(d, 3) AVM_THUNK_ARG(e, 4) AVM_THUNK_ARG(f, 5) \
+    AVM_THUNK_CALL(r, fn(arg0, arg1, arg2, arg3, arg4, arg5))
 
 #ifdef __cplusplus
 }
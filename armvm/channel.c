@@ -0,0 +1,163 @@
+/*
+ * channel.c — message channels shared by several states (avm_newchannel).
+ *
+ * A channel is one host block: an avm_Channel header followed by its
+ * message slots.  avm_mapchannel maps the block into a state as a region
+ * (see vm_mapregion), so every state it is mapped into reads and writes the
+ * same bytes.  Producers fill a slot in place and the consumer reads it in
+ * place; the guest functions below only move the indices.
+ *
+ * Any number of producers claim slots with a CAS on reserve.  Sending marks
+ * the claim ready in a host-side array the guests never see, then moves
+ * tail over every ready claim in order, so messages are published in claim
+ * order without a sender ever waiting for another.  A single consumer
+ * advances head.  Indices are free-running counters; a slot is
+ * index & (slots - 1).
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "avm.h"
+
+/* Host-side owner of a channel; the guest-visible header follows refs */
+struct _CHANNEL {
+    int refs;
+    DWORD size;
+    DWORD *ready;       /* index + 1 of the last claim sent, per slot */
+    avm_Channel ch;
+};
+
+#define OWNER(ch) ((struct _CHANNEL *)((BYTE *)(ch) - offsetof(struct _CHANNEL, ch)))
+
+static BYTE *_slot(avm_Channel *ch, DWORD index) {
+    return (BYTE *)(ch + 1) + (index & (ch->slots - 1)) * ch->slotsize;
+}
+
+avm_Channel *avm_newchannel(DWORD slots, DWORD slotsize) {
+    if (!slots || (slots & (slots - 1))) return NULL;
+    slotsize = (slotsize + 3) & ~3u;
+    size_t size = sizeof(avm_Channel) + (size_t)slots * slotsize;
+    if (!slotsize || size > VM_REGION_BASE) return NULL;
+    /* The ready array follows the slots, outside the mapped range */
+    struct _CHANNEL *c = calloc(1, offsetof(struct _CHANNEL, ch) + size +
+                                   (size_t)slots * sizeof(DWORD));
+    if (!c) return NULL;
+    c->refs = 1;
+    c->size = (DWORD)size;
+    c->ready = (DWORD *)((BYTE *)&c->ch + size);
+    c->ch.slots = slots;
+    c->ch.slotsize = slotsize;
+    return &c->ch;
+}
+
+void avm_closechannel(avm_Channel *ch) {
+    if (!ch) return;
+    struct _CHANNEL *c = OWNER(ch);
+    if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(c);
+}
+
+static void _release(void *owner) {
+    avm_closechannel(owner);
+}
+
+DWORD avm_mapchannel(avm_State *S, avm_Channel *ch) {
+    struct _CHANNEL *c = OWNER(ch);
+    __atomic_add_fetch(&c->refs, 1, __ATOMIC_ACQ_REL);
+    DWORD addr = vm_mapregion(S, (BYTE *)ch, c->size, AVM_MAP_WRITE, _release, ch);
+    if (!addr) avm_closechannel(ch);
+    return addr;
+}
+
+/* Guest-facing functions -------------------------------------------------- */
+
+/* The channel behind a guest address, NULL unless it maps a whole header */
+static avm_Channel *_channel(avm_State *S, DWORD addr, DWORD *base) {
+    DWORD avail;
+    avm_Channel *ch = (avm_Channel *)vm_regionptr(S, addr, AVM_MAP_WRITE, &avail);
+    if (!ch || avail < sizeof(avm_Channel)) return NULL;
+    *base = addr;
+    return ch;
+}
+
+static DWORD _guestaddr(avm_Channel *ch, DWORD base, DWORD index) {
+    return base + (DWORD)(_slot(ch, index) - (BYTE *)ch);
+}
+
+int avm_chanclaim(avm_State *S) {
+    DWORD base;
+    avm_Channel *ch = _channel(S, avm_touinteger(S, 1), &base);
+    if (!ch) {
+        avm_pushinteger(S, 0);
+        return 1;
+    }
+    DWORD r = __atomic_load_n(&ch->reserve, __ATOMIC_RELAXED);
+    do {
+        if (r - __atomic_load_n(&ch->head, __ATOMIC_ACQUIRE) >= ch->slots) {
+            avm_pushinteger(S, 0);
+            return 1;
+        }
+    } while (!__atomic_compare_exchange_n(&ch->reserve, &r, r + 1, 1,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    S->r[0] = _guestaddr(ch, base, r);
+    return 1;
+}
+
+int avm_chansend(avm_State *S) {
+    DWORD base;
+    avm_Channel *ch = _channel(S, avm_touinteger(S, 1), &base);
+    DWORD slot = avm_touinteger(S, 2);
+    if (!ch) {
+        avm_pushinteger(S, -1);
+        return 1;
+    }
+    /* Recover the claim index from the slot; it is the oldest unpublished
+       index with that position, and must be claimed and not sent yet */
+    DWORD *ready = OWNER(ch)->ready;
+    DWORD offset = slot - base - (DWORD)sizeof(avm_Channel);
+    DWORD pos = offset / ch->slotsize;
+    DWORD tail = __atomic_load_n(&ch->tail, __ATOMIC_ACQUIRE);
+    DWORD index = tail + ((pos - tail) & (ch->slots - 1));
+    DWORD reserve = __atomic_load_n(&ch->reserve, __ATOMIC_ACQUIRE);
+    if (offset % ch->slotsize || pos >= ch->slots || index - tail >= reserve - tail ||
+        __atomic_load_n(&ready[pos], __ATOMIC_ACQUIRE) == index + 1) {
+        avm_pushinteger(S, -1);
+        return 1;
+    }
+    __atomic_store_n(&ready[pos], index + 1, __ATOMIC_SEQ_CST);
+
+    /* Publish every ready claim from tail on; whoever sends the oldest
+       claim carries the later ones along.  Sequentially consistent, so of
+       two senders at least one sees the other's claim ready */
+    for (;;) {
+        if (__atomic_load_n(&ready[tail & (ch->slots - 1)], __ATOMIC_SEQ_CST) != tail + 1)
+            break;
+        if (__atomic_compare_exchange_n(&ch->tail, &tail, tail + 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            tail++;
+    }
+    avm_pushinteger(S, 0);
+    return 1;
+}
+
+int avm_chanrecv(avm_State *S) {
+    DWORD base;
+    avm_Channel *ch = _channel(S, avm_touinteger(S, 1), &base);
+    if (!ch || ch->head == __atomic_load_n(&ch->tail, __ATOMIC_ACQUIRE)) {
+        avm_pushinteger(S, 0);
+        return 1;
+    }
+    S->r[0] = _guestaddr(ch, base, ch->head);
+    return 1;
+}
+
+int avm_chanrelease(avm_State *S) {
+    DWORD base;
+    avm_Channel *ch = _channel(S, avm_touinteger(S, 1), &base);
+    if (ch && ch->head != __atomic_load_n(&ch->tail, __ATOMIC_ACQUIRE))
+        __atomic_store_n(&ch->head, ch->head + 1, __ATOMIC_RELEASE);
+    avm_pushinteger(S, 0);
+    return 1;
+}
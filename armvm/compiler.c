@@ -20,6 +20,7 @@ struct _SYMBOL {
 struct _LABEL {
     char szName[LABEL_SIZE];
     DWORD dwPosition;
+    DWORD dwSize;
 };
 
 struct _SET {
@@ -57,6 +58,9 @@ size_t curfilepos = 0;
 
 SYMBOL symbols[MAX_SYMBOLS] = { 0 };
 
+// Set by avm_loadbuffer: leave "bl _name" to host functions unresolved
+BOOL import_externals = 0;
+
 #define OP_SHIFT (('s' << 8) | '%')
 #define OP_ARGS (('p' << 8) | '%')
 #define OP_REGISTER (('r' << 8) | '%')
@@ -137,6 +141,7 @@ struct _EXPORTSTRUCT *GetStdLib(void);
 void add_global(FILE *fp, LPCSTR name) {
     assert(cs.num_globals < MAX_LABELS);
     strcpy(cs.globals[cs.num_globals].szName, name);
+    cs.globals[cs.num_globals].dwSize = 0;
     cs.num_globals++;
 }
 
@@ -419,8 +424,9 @@ void f_comm(FILE *fp, LPCSTR str) {
         return;
     }
     add_global(fp, symbol);
-    add_label(fp, symbol);
+    cs.globals[cs.num_globals - 1].dwSize = size;
     do_align(fp, align);
+    add_label(fp, symbol);
     for (int i = 0; i < size; i++) {
         fputc(0, fp);
     }
@@ -728,11 +734,33 @@ int main(int argc, const char * argv[]) {
 
 #include "avm.h"
 
-int avm_loadbuffer(avm_State *S, const char *code, size_t len) {
-    (void)len; /* compile_buffer reads until NUL; len is accepted for API parity */
+DWORD setpos_branch(LPLOCATION loc, DWORD position);
+
+/* Turn every branch to an undefined _name into a call through an import
+   slot; the slot binds to the host function on first call (vm_bindimport) */
+static void _linkimports(avm_State *S, BYTE *program) {
+    vm_clearimports(S);
+    for (DWORD i = 0; i < cs.num_symbols; i++) {
+        struct _SYMBOL *sym = &cs.symbols[i];
+        if (sym->filled || sym->setpos != setpos_branch || *sym->szName != '_')
+            continue;
+        DWORD slot = vm_addimport(S, sym->szName + 1);
+        if (slot == VM_IMPORT) {
+            fprintf(stderr, "VM: too many imports at %s\n", sym->szName);
+            continue;
+        }
+        DWORD instr = sym->loc.Instruction;
+        BOOL withlink = ((instr >> 24) & 0xf) == OP_BL;
+        *(DWORD *)(program + sym->loc.Position) =
+            OP_BEXT | (instr & 0xf0000000) | (withlink << 19) | VM_IMPORT | slot;
+        sym->filled = 1;
+    }
+}
 
+/* Compile code into a temporary file positioned at its end, or NULL */
+static FILE *_compile(const char *code) {
     FILE *fp = tmpfile();
-    if (!fp) return -1;
+    if (!fp) return NULL;
 
     /* Reset compiler state before each new compilation */
     cs.num_symbols = 0;
@@ -744,38 +772,137 @@ int avm_loadbuffer(avm_State *S, const char *code, size_t len) {
     curfileline = 0;
     main_label  = 0;
 
-    if (!compile_buffer(fp, NULL, NULL, code, &apple_asm_syntax)) {
+    import_externals = 1;
+    BOOL compiled = compile_buffer(fp, NULL, NULL, code, &apple_asm_syntax);
+    import_externals = 0;
+    if (!compiled || fseek(fp, 0, SEEK_END) != 0 || ftell(fp) < 0) {
         fclose(fp);
-        return -1;
+        return NULL;
+    }
+    return fp;
+}
+
+/* Read the compiled code into program, zero-filling it up to progsize */
+static BOOL _readprogram(FILE *fp, BYTE *program, DWORD codesize, DWORD progsize) {
+    BOOL ok = fseek(fp, 0, SEEK_SET) == 0 &&
+              (codesize == 0 || fread(program, codesize, 1, fp) == 1);
+    fclose(fp);
+    memset(program + codesize, 0, progsize - codesize);
+    return ok;
+}
+
+static void _addexports(avm_State *S) {
+    vm_clearexports(S);
+    for (DWORD i = 0; i < cs.num_globals; i++) {
+        vm_addexport(S, cs.globals[i].szName, cs.globals[i].dwPosition, cs.globals[i].dwSize);
     }
+}
+
+int avm_loadbuffer(avm_State *S, const char *code, size_t len) {
+    (void)len; /* compile_buffer reads until NUL; len is accepted for API parity */
+
+    FILE *fp = _compile(code);
+    if (!fp) return -1;
 
-    if (fseek(fp, 0, SEEK_END) != 0) { fclose(fp); return -1; }
-    long ftell_result = ftell(fp);
-    if (ftell_result < 0) { fclose(fp); return -1; }
-    DWORD progsize = (DWORD)ftell_result;
+    /* The program region is padded to a page so that avm_reload can swap in
+       slightly larger code without moving the stack and heap */
+    DWORD codesize = (DWORD)ftell(fp);
+    DWORD progsize = (codesize + AVM_PROGRAM_ALIGN - 1) & ~(AVM_PROGRAM_ALIGN - 1);
 
-    BYTE *new_memory = malloc(progsize + S->stacksize + S->heapsize);
+    BYTE *new_memory = vm_allocmemory(S, progsize);
     if (!new_memory) { fclose(fp); return -1; }
 
-    if (fseek(fp, 0, SEEK_SET) != 0) { free(new_memory); fclose(fp); return -1; }
-    if (fread(new_memory, progsize, 1, fp) != 1 && progsize > 0) {
-        free(new_memory);
+    if (!_readprogram(fp, new_memory, codesize, progsize)) {
+        vm_releasememory(S, new_memory, progsize);
+        return -1;
+    }
+
+    _linkimports(S, new_memory);
+
+    vm_setmemory(S, new_memory, progsize);
+    S->entry_point = (DWORD)main_label;
+
+    _addexports(S);
+
+    return 0;
+}
+
+int avm_reload(avm_State *S, const char *code, size_t len) {
+    (void)len;
+
+    /* A suspended run still points into the old code */
+    if (!S->memory || S->status != AVM_OK || S->depth) return -1;
+
+    FILE *fp = _compile(code);
+    if (!fp) return -1;
+
+    DWORD codesize = (DWORD)ftell(fp);
+    if (codesize > S->progsize) {
+        fprintf(stderr, "VM: reload needs %u bytes, program region has %u\n",
+                codesize, S->progsize);
         fclose(fp);
         return -1;
     }
-    fclose(fp);
 
-    free(S->memory);
-    S->memory = new_memory;
+    BYTE *program = malloc(S->progsize);
+    if (!program) { fclose(fp); return -1; }
+    if (!_readprogram(fp, program, codesize, S->progsize)) {
+        free(program);
+        return -1;
+    }
+
+    /* Carry .comm objects over by name; the stack and heap stay in place */
+    for (DWORD i = 0; i < cs.num_globals; i++) {
+        struct _LABEL *g = &cs.globals[i];
+        const struct _EXPORT *old = g->dwSize ? vm_getexport(S, g->szName) : NULL;
+        if (old && old->size) {
+            memcpy(program + g->dwPosition, S->memory + old->position,
+                   old->size < g->dwSize ? old->size : g->dwSize);
+        }
+    }
+
+    _linkimports(S, program);
+    memcpy(S->memory, program, S->progsize);
+    free(program);
 
-    S->progsize    = progsize;
-    S->r[SP_REG]   = S->stacksize + progsize;
     S->entry_point = (DWORD)main_label;
+    _addexports(S);
+    return 0;
+}
 
-    initialize_memory_manager(S,
-        S->memory + progsize + S->stacksize,
-        S->heapsize);
+int avm_loadimage(avm_State *S, const void *image, size_t len) {
+    const struct _VMHDR *hdr = image;
+    if (len < sizeof(*hdr) || hdr->magic != ID_ORCA ||
+        hdr->programsize > len - sizeof(*hdr))
+        return -1;
 
+    DWORD codesize = hdr->programsize;
+    DWORD progsize = (codesize + AVM_PROGRAM_ALIGN - 1) & ~(AVM_PROGRAM_ALIGN - 1);
+    BYTE *new_memory = vm_allocmemory(S, progsize);
+    if (!new_memory) return -1;
+    memcpy(new_memory, (const BYTE *)(hdr + 1), codesize);
+    memset(new_memory + codesize, 0, progsize - codesize);
+
+    vm_clearimports(S);
+    vm_clearexports(S);
+    vm_setmemory(S, new_memory, progsize);
+    S->entry_point = 0;
+
+    /* The .globl table follows the code: a position and a NUL-terminated
+       name per symbol */
+    const BYTE *p = (const BYTE *)(hdr + 1) + codesize, *end = (const BYTE *)image + len;
+    for (DWORD i = 0; i < hdr->numberofsymbols && end - p > 4; i++) {
+        DWORD position;
+        memcpy(&position, p, 4);
+        const char *name = (const char *)p + 4;
+        const BYTE *nul = memchr(name, 0, end - (const BYTE *)name);
+        if (!nul) break;
+        if (position < codesize) {
+            vm_addexport(S, name, position, 0);
+            if (!strcmp(name, "_main")) S->entry_point = position;
+        }
+        p = nul + 1;
+    }
     return 0;
 }
 
@@ -0,0 +1,228 @@
+/*
+ * dump.c — snapshot and restore of a complete VM state (avm_dump/avm_undump).
+ *
+ * Snapshot file layout:
+ *
+ *   struct _DUMPHDR          registers, CPSR, sizes, heap head, …
+ *   SYMBOL[numcfuncs]        names of registered functions 1..numcfuncs
+ *   struct _IMPORT[numimports]  import slots of the loaded program
+ *   struct _DUMPEXPORT[numexports]  exported symbols, for avm_getfunction
+ *   (padding)                up to the next DUMP_PAGE_SIZE boundary
+ *   memory image             program + stack + heap, memsize bytes
+ *
+ * Pages of the memory image that are entirely zero are skipped with fseek
+ * and become holes in the file, so untouched stack and heap cost no disk
+ * space.  avm_undump maps the file copy-on-write and points S->memory into
+ * the mapping, so restoring a snapshot does not read or copy the image.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "avm.h"
+
+#define ID_AVMS 0x534D5641 /* "AVMS" */
+#define AVM_DUMP_VERSION 4
+#define DUMP_PAGE_SIZE 4096
+
+struct _DUMPHDR {
+    DWORD magic;
+    DWORD version;
+    DWORD r[NUM_REGISTERS];
+    DWORD cpsr;
+    DWORD location;
+    DWORD entry_point;
+    DWORD progsize;
+    DWORD stacksize;
+    DWORD heapsize;
+    DWORD head;
+    DWORD numcfuncs;
+    DWORD numimports;
+    DWORD numexports;
+    DWORD fiber;
+    DWORD fibermain;
+    DWORD memoffset;
+    DWORD memsize;
+};
+
+struct _DUMPEXPORT {
+    SYMBOL name;
+    DWORD position;
+    DWORD size;
+};
+
+static DWORD _align_page(DWORD size) {
+    return (size + DUMP_PAGE_SIZE - 1) & ~(DUMP_PAGE_SIZE - 1);
+}
+
+static BOOL _iszero(const BYTE *p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (p[i]) return 0;
+    }
+    return 1;
+}
+
+int avm_dump(avm_State *S, const char *path) {
+    if (!S->memory) return -1;
+
+    struct _DUMPHDR hdr = {
+        .magic       = ID_AVMS,
+        .version     = AVM_DUMP_VERSION,
+        .cpsr        = S->cpsr,
+        .location    = S->location,
+        .entry_point = S->entry_point,
+        .progsize    = S->progsize,
+        .stacksize   = S->stacksize,
+        .heapsize    = S->heapsize,
+        .head        = S->head,
+        .numcfuncs   = S->registry ? S->registry->count : 0,
+        .numimports  = S->numimports,
+        .numexports  = S->numexports,
+        .fiber       = S->fiber,
+        .fibermain   = S->fibermain,
+        .memsize     = S->progsize + S->stacksize + S->heapsize,
+    };
+    memcpy(hdr.r, S->r, sizeof(hdr.r));
+    hdr.memoffset = _align_page((DWORD)(sizeof(hdr) + hdr.numcfuncs * sizeof(SYMBOL) +
+                                        hdr.numimports * sizeof(struct _IMPORT) +
+                                        hdr.numexports * sizeof(struct _DUMPEXPORT)));
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return -1;
+
+    BOOL ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    for (DWORD i = 1; ok && i <= hdr.numcfuncs; i++) {
+        SYMBOL name = { 0 };
+        strncpy(name, S->registry->names[i], sizeof(SYMBOL) - 1);
+        ok = fwrite(name, sizeof(SYMBOL), 1, fp) == 1;
+    }
+    if (ok && hdr.numimports) {
+        ok = fwrite(S->imports, sizeof(struct _IMPORT), hdr.numimports, fp) == hdr.numimports;
+    }
+    for (DWORD i = 0; ok && S->exports && i <= S->exportmask; i++) {
+        const struct _EXPORT *e = &S->exports[i];
+        if (!e->name) continue;
+        struct _DUMPEXPORT exp = { .position = e->position, .size = e->size };
+        strncpy(exp.name, e->name, sizeof(SYMBOL) - 1);
+        ok = fwrite(&exp, sizeof(exp), 1, fp) == 1;
+    }
+
+    for (DWORD pos = 0; ok && pos < hdr.memsize; pos += DUMP_PAGE_SIZE) {
+        DWORD chunk = hdr.memsize - pos < DUMP_PAGE_SIZE ? hdr.memsize - pos : DUMP_PAGE_SIZE;
+        if (_iszero(S->memory + pos, chunk))
+            continue;
+        ok = fseek(fp, hdr.memoffset + pos, SEEK_SET) == 0 &&
+             fwrite(S->memory + pos, chunk, 1, fp) == 1;
+    }
+
+    /* Extend the file over any trailing zero pages */
+    ok = ok && fflush(fp) == 0 &&
+         ftruncate(fileno(fp), (off_t)hdr.memoffset + hdr.memsize) == 0;
+
+    if (fclose(fp) != 0) ok = 0;
+    if (!ok) {
+        remove(path);
+        return -1;
+    }
+    return 0;
+}
+
+avm_State *avm_undump(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct _DUMPHDR)) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t mapsize = (size_t)st.st_size;
+    BYTE *base = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+
+    struct _DUMPHDR *hdr = (struct _DUMPHDR *)base;
+    if (hdr->magic != ID_AVMS ||
+        hdr->version != AVM_DUMP_VERSION ||
+        hdr->numimports > VM_IMPORT ||
+        sizeof(*hdr) + hdr->numcfuncs * sizeof(SYMBOL) +
+            hdr->numimports * sizeof(struct _IMPORT) +
+            (size_t)hdr->numexports * sizeof(struct _DUMPEXPORT) > hdr->memoffset ||
+        hdr->memsize != hdr->progsize + hdr->stacksize + hdr->heapsize ||
+        (size_t)hdr->memoffset + hdr->memsize > mapsize) {
+        munmap(base, mapsize);
+        return NULL;
+    }
+
+    avm_State *S = avm_newstate(hdr->stacksize, hdr->heapsize);
+    if (!S) {
+        munmap(base, mapsize);
+        return NULL;
+    }
+
+    memcpy(S->r, hdr->r, sizeof(S->r));
+    S->cpsr        = hdr->cpsr;
+    S->location    = hdr->location;
+    S->entry_point = hdr->entry_point;
+    S->progsize    = hdr->progsize;
+    S->head        = hdr->head;
+    S->splow       = hdr->progsize + hdr->stacksize;
+    S->fiber       = hdr->fiber;
+    S->fibermain   = hdr->fibermain;
+    S->memory      = base + hdr->memoffset;
+    S->mapping     = base;
+    S->mapsize     = mapsize;
+
+    /*
+     * Import slots refer to host functions by call id, so restore the names
+     * at their original ids, without functions.  The host re-binds them by
+     * calling avm_register() with the same names.
+     */
+    const SYMBOL *names = (const SYMBOL *)(hdr + 1);
+    for (DWORD i = 1; i <= hdr->numcfuncs; i++) {
+        SYMBOL name;
+        memcpy(name, names[i - 1], sizeof(SYMBOL));
+        name[sizeof(SYMBOL) - 1] = '\0';
+        avm_Registry *R = avm_getregistry(S);
+        if (!R || avm_registryset(R, name, NULL) != i) {
+            avm_close(S);
+            return NULL;
+        }
+    }
+
+    /* Slots keep their binding: call_id is an index into the names above */
+    if (hdr->numimports) {
+        S->imports = malloc(hdr->numimports * sizeof(struct _IMPORT));
+        if (!S->imports) {
+            avm_close(S);
+            return NULL;
+        }
+        memcpy(S->imports, names + hdr->numcfuncs, hdr->numimports * sizeof(struct _IMPORT));
+        S->numimports = hdr->numimports;
+        for (DWORD i = 0; i < S->numimports; i++) {
+            if (S->imports[i].call_id > hdr->numcfuncs)
+                S->imports[i].call_id = 0;
+            S->imports[i].name[sizeof(SYMBOL) - 1] = '\0';
+        }
+    }
+
+    /* Rebuild the export index, so avm_getfunction works on the copy */
+    const struct _DUMPEXPORT *exports =
+        (const struct _DUMPEXPORT *)((const struct _IMPORT *)(names + hdr->numcfuncs) + hdr->numimports);
+    for (DWORD i = 0; i < hdr->numexports; i++) {
+        struct _DUMPEXPORT exp = exports[i];
+        exp.name[sizeof(SYMBOL) - 1] = '\0';
+        vm_addexport(S, exp.name, exp.position, exp.size);
+        if (S->numexports != i + 1) {
+            avm_close(S);
+            return NULL;
+        }
+    }
+
+    return S;
+}
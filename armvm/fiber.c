@@ -0,0 +1,140 @@
+/*
+ * fiber.c — coroutines inside one state (avm_newfiber, fiber_resume/yield).
+ *
+ * A fiber is an avm_Fiber context record followed by its stack, allocated
+ * as one block of the guest heap.  Switching saves r0–r15, CPSR and the
+ * next location into the current record and loads them from the target's,
+ * so it costs two small memcpys and never leaves the interpreter loop: the
+ * host functions below just swap the register file and return.
+ *
+ * The context that is not a fiber (whatever called avm_pcall, or the host)
+ * saves into a lazily allocated record at vm->fibermain; vm->fiber is 0
+ * while it runs.  A fiber's lr is VM_FIBER_RETURN, a sentinel past the end
+ * of the program; vm_run() calls vm_fiberreturn() when control reaches it.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "avm.h"
+
+#define FIBER(vm, addr) ((avm_Fiber *)((vm)->memory + (addr)))
+
+/* Records live in guest memory, where guest code can forge their addresses
+   and rewrite resumer, so every address is checked before it is used */
+static BOOL _isfiber(LPVM vm, DWORD addr) {
+    DWORD memsize = vm->progsize + vm->stacksize + vm->heapsize;
+    return addr && !(addr & 3) && addr <= memsize && memsize - addr >= sizeof(avm_Fiber);
+}
+
+static void _badfiber(LPVM vm, DWORD addr) {
+    fprintf(stderr, "VM: fiber %08x outside guest memory\n", addr);
+    vm_halt(vm, AVM_FAULT);
+}
+
+/* Record of the running context, allocating the main one on first use */
+static DWORD _current(LPVM vm) {
+    if (vm->fiber) return vm->fiber;
+    if (!vm->fibermain) {
+        BYTE *block = my_malloc(vm, sizeof(avm_Fiber));
+        if (!block) return 0;
+        memset(block, 0, sizeof(avm_Fiber));
+        vm->fibermain = (DWORD)(block - vm->memory);
+    }
+    return vm->fibermain;
+}
+
+static void _switch(LPVM vm, DWORD from, DWORD to, DWORD value) {
+    avm_Fiber *f = FIBER(vm, from), *t = FIBER(vm, to);
+    memcpy(f->r, vm->r, sizeof(f->r));
+    f->cpsr = vm->cpsr;
+    f->location = vm->location;
+    memcpy(vm->r, t->r, sizeof(vm->r));
+    vm->cpsr = t->cpsr;
+    vm->location = t->location;
+    vm->r[0] = value;
+    vm->fiber = to == vm->fibermain ? 0 : to;
+    t->status = AVM_FIBER_RUNNING;
+}
+
+static BOOL _resume(LPVM vm, DWORD fiber, DWORD value) {
+    DWORD from = _current(vm);
+    if (!from || !_isfiber(vm, fiber) || FIBER(vm, fiber)->status != AVM_FIBER_SUSPENDED) {
+        fprintf(stderr, "VM: cannot resume fiber %08x\n", fiber);
+        return 0;
+    }
+    if (vm->fiber) FIBER(vm, from)->status = AVM_FIBER_NORMAL;
+    FIBER(vm, fiber)->resumer = from;
+    _switch(vm, from, fiber, value);
+    return 1;
+}
+
+void vm_fiberreturn(LPVM vm) {
+    avm_Fiber *f = FIBER(vm, vm->fiber);
+    if (!_isfiber(vm, f->resumer)) {
+        _badfiber(vm, f->resumer);
+        return;
+    }
+    f->status = AVM_FIBER_DEAD;
+    _switch(vm, vm->fiber, f->resumer, vm->r[0]);
+}
+
+DWORD avm_newfiber(avm_State *S, DWORD fn, DWORD arg, DWORD stacksize) {
+    stacksize = (stacksize + 7) & ~7u;
+    BYTE *block = my_malloc(S, sizeof(avm_Fiber) + stacksize);
+    if (!block) return 0;
+    DWORD fiber = (DWORD)(block - S->memory);
+
+    avm_Fiber *f = (avm_Fiber *)block;
+    memset(f, 0, sizeof(*f));
+    f->r[0] = arg;
+    f->r[SP_REG] = (fiber + sizeof(avm_Fiber) + stacksize) & ~7u;
+    f->r[LR_REG] = S->progsize + VM_FIBER_RETURN;
+    f->location = fn;
+    f->status = AVM_FIBER_SUSPENDED;
+    return fiber;
+}
+
+int avm_runfiber(avm_State *S, DWORD fiber, DWORD value) {
+    DWORD location = S->location, resume = S->resume;
+    int status = S->status;
+    /* Park the caller at the end-of-program sentinel, so the run ends as
+       soon as the fiber yields or returns back to it */
+    S->location = S->progsize;
+    if (!_resume(S, fiber, value)) {
+        S->location = location;
+        return -1;
+    }
+    int result = vm_run(S);
+    if (result == AVM_OK) {
+        S->location = location;
+        S->resume = resume;
+        S->status = status;
+    }
+    return result;
+}
+
+int avm_fiberresume(avm_State *S) {
+    DWORD fiber = avm_touinteger(S, 1), value = avm_touinteger(S, 2);
+    if (!_isfiber(S, fiber)) {
+        _badfiber(S, fiber);
+        return 0;
+    }
+    if (!_resume(S, fiber, value)) avm_pushinteger(S, 0);
+    return 1;
+}
+
+int avm_fiberyield(avm_State *S) {
+    if (!S->fiber) {
+        fprintf(stderr, "VM: fiber_yield outside a fiber\n");
+        return 1;
+    }
+    avm_Fiber *f = FIBER(S, S->fiber);
+    if (!_isfiber(S, f->resumer)) {
+        _badfiber(S, f->resumer);
+        return 0;
+    }
+    f->status = AVM_FIBER_SUSPENDED;
+    _switch(S, S->fiber, f->resumer, S->r[0]);
+    return 1;
+}
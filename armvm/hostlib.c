@@ -0,0 +1,175 @@
+/*
+ * hostlib.c — a small standard library of host functions (avm_openlibs).
+ *
+ * Hosts that only want to run guest code, such as armvm-run, register this
+ * set instead of writing their own.  The table order is fixed: in a fresh
+ * registry the functions get call ids 1, 2, ... in that order, which is
+ * what ORCA images built with "EDU name, id" lines rely on.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "avm.h"
+
+static BYTE *_badrange(avm_State *S, DWORD addr, DWORD len) {
+    fprintf(stderr, "VM: host range 0x%x+%u outside guest memory\n", addr, len);
+    vm_halt(S, AVM_FAULT);
+    return NULL;
+}
+
+/* Host pointer to len bytes at guest address addr, or NULL after halting
+   the run with AVM_FAULT when they are not all guest memory */
+static BYTE *_range(avm_State *S, DWORD addr, DWORD len, DWORD access) {
+    DWORD memsize = S->progsize + S->stacksize + S->heapsize;
+    if (addr >= VM_REGION_BASE) {
+        DWORD avail;
+        BYTE *p = vm_regionptr(S, addr, access, &avail);
+        if (p && avail >= len) return p;
+    } else if (addr <= memsize && len <= memsize - addr) {
+        return S->memory + addr;
+    }
+    return _badrange(S, addr, len);
+}
+
+/* Arena headers and their chunk links are guest-writable, so check them
+   like any other guest pointer before arena.c follows them.  An arena is
+   heap memory, never a mapped region; each chunk is a heap block of more
+   than 16 bytes, which bounds a walk that guest code has made cyclic */
+static BOOL _arena(avm_State *S, DWORD arena, BOOL chunks) {
+    if (arena >= VM_REGION_BASE) return _badrange(S, arena, sizeof(avm_Arena)) != NULL;
+    const avm_Arena *a = (const avm_Arena *)_range(S, arena, sizeof(avm_Arena), AVM_MAP_WRITE);
+    if (!a) return 0;
+    DWORD limit = (S->progsize + S->stacksize + S->heapsize) / 16;
+    for (DWORD link = chunks ? a->chunks : 0, n = 0; link; n++) {
+        if (link >= VM_REGION_BASE || n > limit) return _badrange(S, link, sizeof(DWORD)) != NULL;
+        const BYTE *chunk = _range(S, link, sizeof(DWORD), AVM_MAP_WRITE);
+        if (!chunk) return 0;
+        memcpy(&link, chunk, sizeof(link));
+    }
+    return 1;
+}
+
+static int lib_puts(avm_State *S) {
+    const char *s = avm_checkpointer(S, S->r[0]);
+    if (s) puts(s);
+    return 0;
+}
+
+static int lib_putchar(avm_State *S) {
+    putchar(avm_tointeger(S, 1));
+    return 0;
+}
+
+static int lib_print_int(avm_State *S) {
+    printf("%d\n", avm_tointeger(S, 1));
+    return 0;
+}
+
+static int lib_print_string(avm_State *S) {
+    const char *s = avm_checkpointer(S, S->r[0]);
+    if (s) fputs(s, stdout);
+    return 0;
+}
+
+static int lib_strlen(avm_State *S) {
+    const char *s = avm_checkpointer(S, S->r[0]);
+    avm_pushinteger(S, s ? (int)strlen(s) : 0);
+    return 1;
+}
+
+static int lib_strcmp(avm_State *S) {
+    const char *a = avm_checkpointer(S, S->r[0]);
+    const char *b = avm_checkpointer(S, S->r[1]);
+    avm_pushinteger(S, a && b ? strcmp(a, b) : 0);
+    return 1;
+}
+
+static int lib_memcpy(avm_State *S) {
+    DWORD len = avm_touinteger(S, 3);
+    BYTE *dst = _range(S, S->r[0], len, AVM_MAP_WRITE);
+    BYTE *src = _range(S, S->r[1], len, AVM_MAP_READ);
+    if (dst && src) memmove(dst, src, len);
+    return 1; /* r0 still holds dst */
+}
+
+static int lib_memset(avm_State *S) {
+    DWORD len = avm_touinteger(S, 3);
+    BYTE *dst = _range(S, S->r[0], len, AVM_MAP_WRITE);
+    if (dst) memset(dst, avm_tointeger(S, 2), len);
+    return 1;
+}
+
+static int lib_malloc(avm_State *S) {
+    void *p = my_malloc(S, avm_touinteger(S, 1));
+    avm_pushinteger(S, p ? (int)((BYTE *)p - S->memory) : 0);
+    return 1;
+}
+
+static int lib_free(avm_State *S) {
+    if (S->r[0]) my_free(S, avm_topointer(S, 1));
+    return 0;
+}
+
+static int lib_realloc(avm_State *S) {
+    void *old = S->r[0] ? avm_topointer(S, 1) : NULL;
+    void *p = my_realloc(S, old, avm_touinteger(S, 2));
+    avm_pushinteger(S, p ? (int)((BYTE *)p - S->memory) : 0);
+    return 1;
+}
+
+static int lib_calloc(avm_State *S) {
+    void *p = my_calloc(S, avm_touinteger(S, 1), avm_touinteger(S, 2));
+    avm_pushinteger(S, p ? (int)((BYTE *)p - S->memory) : 0);
+    return 1;
+}
+
+static int lib_arena_new(avm_State *S) {
+    avm_pushinteger(S, (int)avm_newarena(S, avm_touinteger(S, 1)));
+    return 1;
+}
+
+static int lib_arena_alloc(avm_State *S) {
+    if (!_arena(S, S->r[0], 0)) return 0;
+    avm_pushinteger(S, (int)avm_arenaalloc(S, avm_touinteger(S, 1),
+                                           avm_touinteger(S, 2)));
+    return 1;
+}
+
+static int lib_arena_reset(avm_State *S) {
+    if (_arena(S, S->r[0], 1)) avm_arenareset(S, avm_touinteger(S, 1));
+    return 0;
+}
+
+static int lib_arena_free(avm_State *S) {
+    if (S->r[0] && _arena(S, S->r[0], 1)) avm_closearena(S, avm_touinteger(S, 1));
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    avm_CFunction fn;
+} hostlib[] = {
+    { "puts",         lib_puts },
+    { "putchar",      lib_putchar },
+    { "print_int",    lib_print_int },
+    { "print_string", lib_print_string },
+    { "strlen",       lib_strlen },
+    { "strcmp",       lib_strcmp },
+    { "memcpy",       lib_memcpy },
+    { "memset",       lib_memset },
+    { "malloc",       lib_malloc },
+    { "free",         lib_free },
+    { "arena_new",    lib_arena_new },
+    { "arena_alloc",  lib_arena_alloc },
+    { "arena_reset",  lib_arena_reset },
+    { "arena_free",   lib_arena_free },
+    { "realloc",      lib_realloc },
+    { "calloc",       lib_calloc },
+};
+
+void avm_openlibs(avm_State *S) {
+    for (size_t i = 0; i < sizeof(hostlib) / sizeof(*hostlib); i++) {
+        avm_register(S, hostlib[i].name, hostlib[i].fn);
+    }
+}
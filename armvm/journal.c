@@ -0,0 +1,187 @@
+/*
+ * journal.c — deterministic record/replay of host calls (avm_journal).
+ *
+ * Recording wraps vm->syscall: every external call is forwarded to the
+ * real dispatcher and then appended to the journal together with its input
+ * registers, its results and every byte of guest memory the host changed.
+ * Replaying installs a dispatcher that never calls the host and instead
+ * reproduces each recorded call from the journal, so the guest executes the
+ * exact same instruction stream without the host subsystems present.
+ *
+ * Journal layout:
+ *
+ *   struct _JOURNALHDR
+ *   repeated for every call:
+ *     struct _JOURNALENTRY
+ *     struct _JOURNALWRITE + data bytes,  numwrites times
+ *
+ * Only the calls the guest makes itself are journaled.  Host functions that
+ * call back into the dispatcher (avm_ringsubmit, guest code run through
+ * avm_callnested) reach the real one directly while they are recorded: the
+ * outer entry already carries their results and memory writes, and replay,
+ * which never runs the host function, does not make those calls at all.
+ *
+ * Memory changes are found by comparing guest memory with a shadow copy
+ * taken right before the call, which makes recording O(memory size) per
+ * host call.  That is fine for an investigation mode and keeps the hot path
+ * of normal execution untouched.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "avm.h"
+
+#define ID_AVMJ 0x4A4D5641 /* "AVMJ" */
+#define JOURNAL_ARGS 4
+#define JOURNAL_CHUNK 64
+#define JOURNAL_GAP 8 /* equal bytes tolerated inside one write range */
+
+struct _JOURNALHDR {
+    DWORD magic;
+    DWORD memsize;
+};
+
+struct _JOURNALENTRY {
+    DWORD call_id;
+    DWORD args[JOURNAL_ARGS];
+    DWORD result[2];
+    DWORD numwrites;
+};
+
+struct _JOURNALWRITE {
+    DWORD offset;
+    DWORD length;
+};
+
+static DWORD _memsize(LPVM vm) {
+    return vm->progsize + vm->stacksize + vm->heapsize;
+}
+
+/* Find the next byte at or after pos where memory and shadow differ */
+static DWORD _nextdiff(const BYTE *a, const BYTE *b, DWORD pos, DWORD size) {
+    while (pos < size && pos % JOURNAL_CHUNK) {
+        if (a[pos] != b[pos]) return pos;
+        pos++;
+    }
+    while (pos + JOURNAL_CHUNK <= size && !memcmp(a + pos, b + pos, JOURNAL_CHUNK)) {
+        pos += JOURNAL_CHUNK;
+    }
+    while (pos < size && a[pos] == b[pos]) pos++;
+    return pos;
+}
+
+static DWORD _record_syscall(LPVM vm, DWORD call_id) {
+    DWORD memsize = _memsize(vm);
+    if (vm->shadowsize != memsize) {
+        BYTE *shadow = realloc(vm->shadow, memsize);
+        if (!shadow) {
+            fprintf(stderr, "VM: journal out of memory\n");
+            return vm->journaled(vm, call_id);
+        }
+        vm->shadow = shadow;
+        vm->shadowsize = memsize;
+    }
+    memcpy(vm->shadow, vm->memory, memsize);
+
+    struct _JOURNALENTRY entry = { .call_id = call_id };
+    memcpy(entry.args, vm->r, sizeof(entry.args));
+    vm->syscall = vm->journaled;
+    entry.result[0] = vm->journaled(vm, call_id);
+    vm->syscall = _record_syscall;
+    entry.result[1] = vm->r[1];
+
+    long entrypos = ftell(vm->journal);
+    fwrite(&entry, sizeof(entry), 1, vm->journal);
+
+    for (DWORD pos = _nextdiff(vm->memory, vm->shadow, 0, memsize); pos < memsize;) {
+        DWORD end = pos + 1, gap = 0;
+        for (; end + gap < memsize && gap < JOURNAL_GAP; ) {
+            if (vm->memory[end + gap] != vm->shadow[end + gap]) {
+                end += gap + 1;
+                gap = 0;
+            } else {
+                gap++;
+            }
+        }
+        struct _JOURNALWRITE write = { .offset = pos, .length = end - pos };
+        fwrite(&write, sizeof(write), 1, vm->journal);
+        fwrite(vm->memory + pos, write.length, 1, vm->journal);
+        entry.numwrites++;
+        pos = _nextdiff(vm->memory, vm->shadow, end, memsize);
+    }
+
+    if (entry.numwrites) {
+        fseek(vm->journal, entrypos, SEEK_SET);
+        fwrite(&entry, sizeof(entry), 1, vm->journal);
+        fseek(vm->journal, 0, SEEK_END);
+    }
+    return entry.result[0];
+}
+
+static DWORD _replay_syscall(LPVM vm, DWORD call_id) {
+    struct _JOURNALENTRY entry;
+    if (fread(&entry, sizeof(entry), 1, vm->journal) != 1) {
+        fprintf(stderr, "VM: journal exhausted at call %u\n", call_id);
+        return vm->r[0];
+    }
+    if (entry.call_id != call_id || memcmp(entry.args, vm->r, sizeof(entry.args))) {
+        fprintf(stderr, "VM: replay diverged (recorded call %u, executing %u)\n",
+                entry.call_id, call_id);
+    }
+    DWORD memsize = _memsize(vm);
+    for (DWORD i = 0; i < entry.numwrites; i++) {
+        struct _JOURNALWRITE write;
+        if (fread(&write, sizeof(write), 1, vm->journal) != 1)
+            break;
+        if (write.offset > memsize || write.length > memsize - write.offset) {
+            fseek(vm->journal, write.length, SEEK_CUR);
+            continue;
+        }
+        fread(vm->memory + write.offset, write.length, 1, vm->journal);
+    }
+    vm->r[1] = entry.result[1];
+    return entry.result[0];
+}
+
+int avm_journal(avm_State *S, int mode, const char *path) {
+    if (S->journal) {
+        fclose(S->journal);
+        S->journal = NULL;
+        S->syscall = S->journaled;
+        S->journaled = NULL;
+        free(S->shadow);
+        S->shadow = NULL;
+        S->shadowsize = 0;
+    }
+
+    struct _JOURNALHDR hdr = { .magic = ID_AVMJ, .memsize = _memsize(S) };
+    switch (mode) {
+        case AVM_JOURNAL_OFF:
+            return 0;
+        case AVM_JOURNAL_RECORD:
+            S->journal = fopen(path, "wb");
+            if (!S->journal || fwrite(&hdr, sizeof(hdr), 1, S->journal) != 1)
+                break;
+            S->journaled = S->syscall;
+            S->syscall = _record_syscall;
+            return 0;
+        case AVM_JOURNAL_REPLAY: {
+            struct _JOURNALHDR in;
+            S->journal = fopen(path, "rb");
+            if (!S->journal ||
+                fread(&in, sizeof(in), 1, S->journal) != 1 ||
+                in.magic != hdr.magic || in.memsize != hdr.memsize)
+                break;
+            S->journaled = S->syscall;
+            S->syscall = _replay_syscall;
+            return 0;
+        }
+    }
+
+    if (S->journal) {
+        fclose(S->journal);
+        S->journal = NULL;
+    }
+    return -1;
+}
@@ -1,88 +1,441 @@
+#include <string.h>
+
 #include "vm.h"
 
-#define FALSE 0
-#define TRUE 1
+// Two-level segregated-fit (TLSF) allocator for the guest heap.
+//
+// Free blocks sit in size-class lists.  The first level splits sizes by
+// powers of two, the second splits each power of two into SL_COUNT equal
+// steps, and one bitmap per level marks the non-empty lists.  Finding a
+// list that can satisfy a request is a couple of bit scans, so my_malloc
+// and my_free take constant time however fragmented the heap is, and a
+// request never takes a block more than one step larger than it needs.
+// Freed blocks merge with free neighbours on both sides immediately.
+//
+// Everything, including the control block with the bitmaps and list heads,
+// lives in guest memory and refers to blocks by their offset into
+// vm->memory rather than by host pointers, so the heap image stays valid
+// when the guest memory is moved or mapped at a different address (see
+// avm_dump/avm_undump).  vm->head is the offset of the control block.  The
+// heap always sits after the program and stack, so offset 0 is free to mean
+// "no block".
+//
+// A heap started with vm_initheap can be smaller than the space reserved
+// for it.  When no free block fits, _grow moves the end sentinel forward
+// sbrk-style and frees the new span into the heap, never past the limit.
+//
+// Such a heap lives in a fresh anonymous mapping, which reads as zeros.
+// Control.fresh tracks where the never-used part begins: the allocator only
+// writes the first MIN_BLOCK bytes of a block (header and free links), so
+// handing out a block or creating one moves fresh past it, and my_calloc
+// only clears what lies below.
+
+#define ALIGN_LOG2 4
+#define ALIGN (1u << ALIGN_LOG2)        // payload alignment
+#define SL_LOG2 4
+#define SL_COUNT (1u << SL_LOG2)
+#define FL_SHIFT (SL_LOG2 + ALIGN_LOG2)
+#define SMALL_SIZE (1u << FL_SHIFT)     // sizes below this map linearly
+#define FL_COUNT (32 - FL_SHIFT + 1)
+
+// Blocks are multiples of ALIGN and start ALIGN - HEADER past an aligned
+// address, so every payload is ALIGN-aligned.  The links of a free block
+// use the first bytes of its payload, hence the minimum block size.
+#define HEADER 8
+#define MIN_BLOCK ALIGN
+#define FREE_BIT 1u
+
+typedef struct Block {
+    DWORD prev;         // physically preceding block, NODE_NULL for the first
+    DWORD size;         // bytes including the header, | FREE_BIT when free
+    DWORD next_free;    // free-list links, only valid while the block is free
+    DWORD prev_free;
+} Block;
+
+typedef struct Control {
+    unsigned long long allocs;  // counters for avm_memstats
+    unsigned long long frees;
+    DWORD freebytes;
+    DWORD freeblocks;
+    DWORD flmap;
+    DWORD slmap[FL_COUNT];
+    DWORD heads[FL_COUNT][SL_COUNT];
+    DWORD end;          // offset of the end sentinel
+    DWORD limit;        // offset the arena may grow to
+    DWORD fresh;        // bytes from here up to end are still zero
+} Control;
+
+#define NODE_NULL 0
+#define NODE(vm, offset) ((Block *)((vm)->memory + (offset)))
+#define NODE_OFFSET(vm, node) ((DWORD)((BYTE *)(node) - (vm)->memory))
+#define CONTROL(vm) ((Control *)((vm)->memory + (vm)->head))
+#define BLOCKSIZE(b) ((b)->size & ~FREE_BIT)
+
+static inline DWORD _fls(DWORD x) {
+    return 31 - __builtin_clz(x);
+}
+
+static void _mapping(DWORD size, DWORD *fl, DWORD *sl) {
+    if (size < SMALL_SIZE) {
+        *fl = 0;
+        *sl = size / (SMALL_SIZE / SL_COUNT);
+    } else {
+        DWORD f = _fls(size);
+        *sl = (size >> (f - SL_LOG2)) ^ SL_COUNT;
+        *fl = f - FL_SHIFT + 1;
+    }
+}
+
+static void _insert(LPVM vm, DWORD offset) {
+    Control *c = CONTROL(vm);
+    Block *b = NODE(vm, offset);
+    DWORD fl, sl;
+    _mapping(BLOCKSIZE(b), &fl, &sl);
+    b->prev_free = NODE_NULL;
+    b->next_free = c->heads[fl][sl];
+    if (b->next_free != NODE_NULL)
+        NODE(vm, b->next_free)->prev_free = offset;
+    c->heads[fl][sl] = offset;
+    c->flmap |= 1u << fl;
+    c->slmap[fl] |= 1u << sl;
+    c->freebytes += BLOCKSIZE(b);
+    c->freeblocks++;
+}
+
+static void _remove(LPVM vm, DWORD offset) {
+    Control *c = CONTROL(vm);
+    Block *b = NODE(vm, offset);
+    DWORD fl, sl;
+    _mapping(BLOCKSIZE(b), &fl, &sl);
+    c->freebytes -= BLOCKSIZE(b);
+    c->freeblocks--;
+    if (b->next_free != NODE_NULL)
+        NODE(vm, b->next_free)->prev_free = b->prev_free;
+    if (b->prev_free != NODE_NULL) {
+        NODE(vm, b->prev_free)->next_free = b->next_free;
+    } else {
+        c->heads[fl][sl] = b->next_free;
+        if (c->heads[fl][sl] == NODE_NULL) {
+            c->slmap[fl] &= ~(1u << sl);
+            if (!c->slmap[fl])
+                c->flmap &= ~(1u << fl);
+        }
+    }
+}
+
+// First free block in a class that holds size bytes for certain, or NODE_NULL
+static DWORD _find(LPVM vm, DWORD size) {
+    Control *c = CONTROL(vm);
+    DWORD fl, sl;
+    // Round up to the next class, so any block in it is large enough
+    if (size >= SMALL_SIZE)
+        size += (1u << (_fls(size) - SL_LOG2)) - 1;
+    _mapping(size, &fl, &sl);
+    if (fl >= FL_COUNT)
+        return NODE_NULL;
+    DWORD slmap = c->slmap[fl] & (~0u << sl);
+    if (!slmap) {
+        DWORD flmap = fl + 1 < 32 ? c->flmap & (~0u << (fl + 1)) : 0;
+        if (!flmap)
+            return NODE_NULL;
+        fl = __builtin_ctz(flmap);
+        slmap = c->slmap[fl];
+    }
+    return c->heads[fl][__builtin_ctz(slmap)];
+}
 
-// Node structure to represent a block of allocated memory
-typedef struct Node {
-    size_t size;
-    int used;
-    struct Node* next;
-    struct Node* prev;
-} Node;
+void vm_initheap(LPVM vm, void *buffer, DWORD buffer_size, DWORD initial) {
+    DWORD start = NODE_OFFSET(vm, buffer);
+    vm->head = (start + 7) & ~7u;
+    Control *c = CONTROL(vm);
+    memset(c, 0, sizeof(Control));
 
+    // One free block spanning the arena, then a used, empty sentinel so the
+    // last block always has a physical successor
+    DWORD first = ((vm->head + sizeof(Control) + HEADER + ALIGN - 1) & ~(ALIGN - 1)) - HEADER;
+    if (first + MIN_BLOCK + HEADER > start + buffer_size)
+        return;
+    if (initial > buffer_size)
+        initial = buffer_size;
+    if (first + MIN_BLOCK + HEADER > start + initial)
+        initial = first + MIN_BLOCK + HEADER - start;
+    c->limit = first + ((start + buffer_size - HEADER - first) & ~(ALIGN - 1));
+    c->end = first + ((start + initial - HEADER - first) & ~(ALIGN - 1));
+    // Growable heaps sit in a new anonymous mapping (vm_setmemory)
+    c->fresh = vm->heapinit ? first + MIN_BLOCK : c->end;
+    DWORD size = c->end - first;
+    Block *b = NODE(vm, first);
+    b->prev = NODE_NULL;
+    b->size = size | FREE_BIT;
+    Block *sentinel = NODE(vm, c->end);
+    sentinel->prev = first;
+    sentinel->size = 0;
+    _insert(vm, first);
+}
 
 // Function to initialize the memory manager
 void initialize_memory_manager(LPVM vm, void* buffer, size_t buffer_size) {
-    // Initialize the linked list with a single node representing the entire buffer
-    vm->head = (Node*)buffer;
-    vm->head->size = buffer_size - sizeof(Node);
-    vm->head->next = NULL;
-    vm->head->prev = NULL;
-    vm->head->used = FALSE;
+    vm_initheap(vm, buffer, (DWORD)buffer_size, (DWORD)buffer_size);
 }
 
-// Function to allocate memory from the buffer
-void* my_malloc(LPVM vm, size_t size) {
-    Node* current = vm->head;
-    
-    // Traverse the linked list to find a suitable block
-    while (current != NULL) {
-        if (!current->used && current->size >= size) {
-            // Allocate memory from the current block
-            if (current->size > size + sizeof(Node)) {
-                // If there's enough space, create a new node for the remaining block
-                Node* new_block = (Node*)((char*)current + sizeof(Node) + size);
-                new_block->size = current->size - size - sizeof(Node);
-                new_block->next = current->next;
-                new_block->prev = current;
-                new_block->used = FALSE;
-                if (current->next != NULL) {
-                    current->next->prev = new_block;
-                }
-                current->next = new_block;
-            }
-            // Update the current block size and return the allocated memory
-            current->size = size;
-            current->used = TRUE;
-            return (void*)(current + 1); // Skip the Node header
-        }
-        // Move to the next block
-        current = current->next;
+static void _free(LPVM vm, void* ptr);
+
+// A block ending at end is in use and its successor's header may be written
+static inline void _dirty(Control *c, DWORD end) {
+    if (c->fresh < end + MIN_BLOCK)
+        c->fresh = end + MIN_BLOCK;
+}
+
+// Extend the arena so a block of need bytes fits; 0 when the limit is hit.
+// The arena at least doubles each time, so a heap that keeps growing is
+// extended a logarithmic number of times.
+static BOOL _grow(LPVM vm, DWORD need) {
+    Control *c = CONTROL(vm);
+    if (c->end == c->limit)     // also a heap too small to hold any block
+        return 0;
+    // A free block just before the sentinel merges with the new span
+    Block *last = NODE(vm, NODE(vm, c->end)->prev);
+    if (last->size & FREE_BIT)
+        need = need > BLOCKSIZE(last) ? need - BLOCKSIZE(last) : MIN_BLOCK;
+    DWORD arena = c->end - vm->head;
+    DWORD step = need > arena ? need : arena;
+    // Round the new end up to a page so whole pages get committed
+    DWORD end = ((c->end + step + HEADER + AVM_PROGRAM_ALIGN - 1)
+                 & ~(AVM_PROGRAM_ALIGN - 1)) - HEADER;
+    if (end > c->limit || end < c->end)
+        end = c->limit;
+    if (end - c->end < need)
+        return 0;
+
+    // The old sentinel becomes a used block covering the new span, which
+    // _free then merges with its free neighbour
+    DWORD offset = c->end;
+    Block *b = NODE(vm, offset);
+    b->size = end - offset;
+    Block *sentinel = NODE(vm, end);
+    sentinel->prev = offset;
+    sentinel->size = 0;
+    c->end = end;
+    _dirty(c, offset);
+    _free(vm, (BYTE *)b + HEADER);
+    return 1;
+}
+
+static void *_malloc(LPVM vm, size_t size) {
+    if (size > 0x7fffffff) goto oom;
+    DWORD need = ((DWORD)size + HEADER + ALIGN - 1) & ~(ALIGN - 1);
+    if (need < MIN_BLOCK) need = MIN_BLOCK;
+
+    DWORD offset = _find(vm, need);
+    if (offset == NODE_NULL) {
+        // Grow by at least a full class step so _find's round-up is covered
+        DWORD slack = need >= SMALL_SIZE ? 1u << (_fls(need) - SL_LOG2) : 0;
+        if (!_grow(vm, need + slack)) goto oom;
+        offset = _find(vm, need);
+        if (offset == NODE_NULL) goto oom;
+    }
+    _remove(vm, offset);
+
+    Block *b = NODE(vm, offset);
+    DWORD have = BLOCKSIZE(b);
+    if (have - need >= MIN_BLOCK) {
+        // Split off the tail and give it back
+        DWORD rest = offset + need;
+        Block *r = NODE(vm, rest);
+        r->prev = offset;
+        r->size = (have - need) | FREE_BIT;
+        NODE(vm, rest + have - need)->prev = rest;
+        _insert(vm, rest);
+        have = need;
     }
-    
+    b->size = have;
+    _dirty(CONTROL(vm), offset + have);
+    CONTROL(vm)->allocs++;
+    return (BYTE *)b + HEADER;
+
+oom:
     fprintf(stderr, "VM: Out of memory for block of %zu bytes\n", size);
     // No suitable block found
     return NULL;
 }
 
+static void _free(LPVM vm, void* ptr) {
+    DWORD offset = NODE_OFFSET(vm, ptr) - HEADER;
+    Block *b = NODE(vm, offset);
+    if (b->size & FREE_BIT)
+        return; // already free
+    DWORD size = b->size;
+
+    // Absorb the following block if it is free
+    Block *next = NODE(vm, offset + size);
+    if (next->size & FREE_BIT) {
+        _remove(vm, offset + size);
+        size += BLOCKSIZE(next);
+    }
+
+    // Merge into the preceding block if it is free
+    if (b->prev != NODE_NULL && (NODE(vm, b->prev)->size & FREE_BIT)) {
+        DWORD prev = b->prev;
+        _remove(vm, prev);
+        size += offset - prev;
+        offset = prev;
+        b = NODE(vm, offset);
+    }
+
+    b->size = size | FREE_BIT;
+    NODE(vm, offset + size)->prev = offset;
+    _insert(vm, offset);
+}
+
+// _free for blocks the guest or host gave back, as counted by avm_memstats
+static void _release(LPVM vm, void *ptr) {
+    if (!(NODE(vm, NODE_OFFSET(vm, ptr) - HEADER)->size & FREE_BIT))
+        CONTROL(vm)->frees++;
+    _free(vm, ptr);
+}
+
+// Resize the block at offset in place to need bytes; 0 if the next block
+// cannot supply the difference
+static BOOL _resize(LPVM vm, DWORD offset, DWORD need) {
+    Block *b = NODE(vm, offset);
+    DWORD have = b->size;
+    if (need > have) {
+        Block *next = NODE(vm, offset + have);
+        // At the end of the arena, make room by growing it first
+        BOOL last = next->size == 0 ||
+            ((next->size & FREE_BIT) && NODE(vm, offset + have + BLOCKSIZE(next))->size == 0);
+        if (last && have + BLOCKSIZE(next) < need && !_grow(vm, need - have))
+            return 0;
+        if (!(next->size & FREE_BIT) || have + BLOCKSIZE(next) < need)
+            return 0;
+        _remove(vm, offset + have);
+        have += BLOCKSIZE(next);
+        b->size = have;
+        NODE(vm, offset + have)->prev = offset;
+    }
+    if (have - need >= MIN_BLOCK) {
+        // Give the tail back, merging it with a free successor
+        DWORD rest = offset + need;
+        Block *r = NODE(vm, rest);
+        r->prev = offset;
+        r->size = have - need;
+        b->size = need;
+        _free(vm, (BYTE *)r + HEADER);
+        have = need;
+    }
+    _dirty(CONTROL(vm), offset + have);
+    return 1;
+}
+
+static void *_realloc(LPVM vm, void *ptr, size_t size) {
+    if (size > 0x7fffffff) return _malloc(vm, size);
+    DWORD need = ((DWORD)size + HEADER + ALIGN - 1) & ~(ALIGN - 1);
+    if (need < MIN_BLOCK) need = MIN_BLOCK;
+    DWORD offset = NODE_OFFSET(vm, ptr) - HEADER;
+    if (_resize(vm, offset, need))
+        return ptr;
+    // Offsets stay valid even if _grow extended the heap
+    DWORD have = NODE(vm, offset)->size;
+    BYTE *moved = _malloc(vm, size);
+    if (!moved) return NULL;
+    memcpy(moved, vm->memory + offset + HEADER, have - HEADER);
+    _release(vm, vm->memory + offset + HEADER);
+    return moved;
+}
+
+static void *_calloc(LPVM vm, size_t size) {
+    DWORD fresh = CONTROL(vm)->fresh;
+    DWORD end = CONTROL(vm)->end;
+    BYTE *ptr = _malloc(vm, size);
+    if (!ptr) return NULL;
+    // Only the part below the old fresh mark can hold stale data, and the
+    // old end sentinel if the heap grew
+    if (CONTROL(vm)->end != end && fresh < end + MIN_BLOCK)
+        fresh = end + MIN_BLOCK;
+    DWORD offset = NODE_OFFSET(vm, ptr);
+    if (offset < fresh)
+        memset(ptr, 0, fresh - offset < size ? fresh - offset : size);
+    return ptr;
+}
+
+// Function to allocate memory from the buffer
+void* my_malloc(LPVM vm, size_t size) {
+    if (!vm->threads) return _malloc(vm, size);
+    vm_lockheap(vm);
+    void *ptr = _malloc(vm, size);
+    vm_unlockheap(vm);
+    return ptr;
+}
+
 // Function to free previously allocated memory
 void my_free(LPVM vm, void* ptr) {
     if (ptr == NULL) {
         // Ignore freeing NULL pointer
         return;
     }
-    
-    // Find the Node header before the given pointer
-    Node* node = ((Node*)ptr) - 1;
-    
-    node->used = FALSE;
-    
-    if (node->prev && !node->prev->used) {
-        node->prev->next = node->next;
-        if (node->next) {
-            node->next->prev = node->prev;
-        }
-        node->prev->size += node->size + sizeof(Node);
-        node = node->prev;
+    if (!vm->threads) {
+        _release(vm, ptr);
+        return;
     }
-    
-    if (node->next && !node->next->used) {
-        node->next->prev = node->prev;
-        if (node->prev) {
-            node->prev->next = node->next;
+    vm_lockheap(vm);
+    _release(vm, ptr);
+    vm_unlockheap(vm);
+}
+
+// Function to resize a block, moving it only when it cannot grow in place
+void* my_realloc(LPVM vm, void* ptr, size_t size) {
+    if (ptr == NULL) return my_malloc(vm, size);
+    if (size == 0) {
+        my_free(vm, ptr);
+        return NULL;
+    }
+    if (!vm->threads) return _realloc(vm, ptr, size);
+    vm_lockheap(vm);
+    ptr = _realloc(vm, ptr, size);
+    vm_unlockheap(vm);
+    return ptr;
+}
+
+// Function to allocate zeroed memory for count elements of size bytes
+void* my_calloc(LPVM vm, size_t count, size_t size) {
+    if (size && count > (size_t)0x7fffffff / size) {
+        fprintf(stderr, "VM: Out of memory for %zu blocks of %zu bytes\n", count, size);
+        return NULL;
+    }
+    if (!vm->threads) return _calloc(vm, count * size);
+    vm_lockheap(vm);
+    void *ptr = _calloc(vm, count * size);
+    vm_unlockheap(vm);
+    return ptr;
+}
+
+void avm_memstats(LPVM vm, avm_MemStats *out) {
+    memset(out, 0, sizeof(*out));
+    if (!vm->memory) return;
+    // Threads share their parent's memory, heap and heap lock
+    if (vm->threads) vm_lockheap(vm);
+    Control *c = CONTROL(vm);
+    DWORD first = ((vm->head + sizeof(Control) + HEADER + ALIGN - 1) & ~(ALIGN - 1)) - HEADER;
+    if (c->end > first) {
+        out->heapsize = c->end - first;
+        out->inuse = out->heapsize - c->freebytes;
+    }
+    out->free = c->freebytes;
+    out->freeblocks = c->freeblocks;
+    out->allocs = c->allocs;
+    out->frees = c->frees;
+    // The largest free block is in the highest non-empty list
+    if (c->flmap) {
+        DWORD fl = _fls(c->flmap);
+        for (DWORD b = c->heads[fl][_fls(c->slmap[fl])]; b != NODE_NULL; b = NODE(vm, b)->next_free) {
+            if (BLOCKSIZE(NODE(vm, b)) > out->largestfree)
+                out->largestfree = BLOCKSIZE(NODE(vm, b));
         }
-        node->next->size += node->size + sizeof(Node);
-        node = node->next;
     }
+    if (vm->threads) vm_unlockheap(vm);
+
+    DWORD top = vm->parent ? vm->stacktop : vm->progsize + vm->stacksize;
+    out->stacksize = vm->parent ? vm->stacktop - vm->stackblock : vm->stacksize;
+    out->stacklow = vm->splow;
+    out->stackused = top - vm->splow;
 }
@@ -0,0 +1,241 @@
+/*
+ * pool.c — pre-forked worker processes running one loaded module
+ * (avm_newpool).
+ *
+ * The supervisor copies the module's memory image into a sealed memfd once.
+ * Every worker is a fork of the supervisor that maps the memfd private, so
+ * all workers share the assembled code (and any data they never write)
+ * through the page cache; nothing is re-assembled or copied per worker.
+ *
+ * Each worker owns a SOCK_SEQPACKET socket pair.  The supervisor hands an
+ * avm_Request to an idle worker, the worker calls the named function and
+ * sends an avm_Reply back.  A worker that dies takes down only its own
+ * request, which is answered with AVM_FAULT, and is forked again.  So does
+ * one that overruns the pool's request timeout: a runaway guest never
+ * returns to recv, so it is killed rather than asked to stop.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "avm.h"
+
+struct _WORKER {
+    pid_t pid;
+    int fd;       /* supervisor end of the socket pair */
+    int job;      /* index of the request being run, -1 when idle */
+    long long deadline;   /* ms on the monotonic clock, with a timeout */
+};
+
+struct avm_Pool {
+    avm_State *module;
+    int memfd;
+    DWORD memsize;
+    void (*setup)(avm_State *S);
+    DWORD timeout;        /* ms per request, 0 for none */
+    DWORD numworkers;
+    struct _WORKER workers[];
+};
+
+static long long _now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Copy the module's memory into an immutable memfd */
+static int _sealmodule(avm_State *S, DWORD memsize) {
+    int fd = memfd_create("avm-module", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) return -1;
+    DWORD done = 0;
+    while (done < memsize) {
+        ssize_t n = write(fd, S->memory + done, memsize - done);
+        if (n <= 0) break;
+        done += (DWORD)n;
+    }
+    if (done != memsize ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void _serve(avm_Pool *P, int fd) {
+    avm_State *S = P->module;
+    BYTE *memory = mmap(NULL, P->memsize, PROT_READ | PROT_WRITE, MAP_PRIVATE, P->memfd, 0);
+    if (memory == MAP_FAILED) _exit(1);
+    vm_freememory(S);
+    S->memory = memory;
+    S->mapping = memory;
+    S->mapsize = P->memsize;
+    if (P->setup) P->setup(S);
+
+    avm_Request req;
+    while (recv(fd, &req, sizeof(req), 0) == (ssize_t)sizeof(req)) {
+        avm_Reply rep = { .id = req.id, .status = -1 };
+        req.function[sizeof(req.function) - 1] = '\0';
+        DWORD fn = avm_getfunction(S, req.function);
+        if (fn != AVM_NOFUNCTION && req.nargs <= AVM_POOL_ARGS) {
+            rep.status = avm_callbatch(S, fn, req.args, (int)req.nargs, 1, &rep.result);
+        }
+        if (send(fd, &rep, sizeof(rep), MSG_NOSIGNAL) != (ssize_t)sizeof(rep))
+            break;
+    }
+    _exit(0);
+}
+
+static BOOL _spawn(avm_Pool *P, DWORD i) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) return 0;
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return 0;
+    }
+    if (pid == 0) {
+        for (DWORD j = 0; j < P->numworkers; j++) {
+            if (P->workers[j].fd >= 0) close(P->workers[j].fd);
+        }
+        close(sv[0]);
+        _serve(P, sv[1]);
+    }
+    close(sv[1]);
+    P->workers[i] = (struct _WORKER){ .pid = pid, .fd = sv[0], .job = -1 };
+    return 1;
+}
+
+static void _reap(struct _WORKER *w) {
+    if (w->fd >= 0) close(w->fd);
+    if (w->pid > 0) {
+        kill(w->pid, SIGKILL);
+        waitpid(w->pid, NULL, 0);
+    }
+    w->fd = -1;
+    w->pid = 0;
+    w->job = -1;
+}
+
+avm_Pool *avm_newpool(avm_State *module, DWORD workers, void (*setup)(avm_State *S)) {
+    if (!module->memory || !workers) return NULL;
+    avm_Pool *P = calloc(1, sizeof(avm_Pool) + workers * sizeof(struct _WORKER));
+    if (!P) return NULL;
+    P->module = module;
+    P->memsize = module->progsize + module->stacksize + module->heapsize;
+    P->setup = setup;
+    P->numworkers = workers;
+    for (DWORD i = 0; i < workers; i++) {
+        P->workers[i].fd = -1;
+    }
+    P->memfd = _sealmodule(module, P->memsize);
+    if (P->memfd < 0) {
+        free(P);
+        return NULL;
+    }
+    for (DWORD i = 0; i < workers; i++) {
+        if (!_spawn(P, i)) {
+            avm_closepool(P);
+            return NULL;
+        }
+    }
+    return P;
+}
+
+void avm_setpooltimeout(avm_Pool *P, DWORD ms) {
+    P->timeout = ms;
+}
+
+/* Answer the worker's request with AVM_FAULT and fork a replacement */
+static BOOL _fail(avm_Pool *P, DWORD i, const avm_Request *reqs, avm_Reply *replies) {
+    int job = P->workers[i].job;
+    replies[job] = (avm_Reply){ .id = reqs[job].id, .status = AVM_FAULT };
+    _reap(&P->workers[i]);
+    return _spawn(P, i);
+}
+
+int avm_poolrun(avm_Pool *P, const avm_Request *reqs, avm_Reply *replies, DWORD count) {
+    struct pollfd fds[P->numworkers];
+    DWORD next = 0, done = 0;
+    while (done < count) {
+        /* Hand out requests to idle workers */
+        for (DWORD i = 0; i < P->numworkers && next < count; i++) {
+            struct _WORKER *w = &P->workers[i];
+            if (w->job >= 0 || w->fd < 0) continue;
+            if (send(w->fd, &reqs[next], sizeof(avm_Request), MSG_NOSIGNAL) != (ssize_t)sizeof(avm_Request)) {
+                _reap(w);
+                if (!_spawn(P, i)) return -1;
+                continue;
+            }
+            w->job = (int)next++;
+            if (P->timeout) w->deadline = _now() + P->timeout;
+        }
+
+        /* Wait for a reply, or until the earliest deadline */
+        DWORD n = 0;
+        long long now = P->timeout ? _now() : 0, wait = -1;
+        for (DWORD i = 0; i < P->numworkers; i++) {
+            struct _WORKER *w = &P->workers[i];
+            fds[i] = (struct pollfd){ .fd = w->job >= 0 ? w->fd : -1, .events = POLLIN };
+            if (fds[i].fd < 0) continue;
+            n++;
+            if (P->timeout) {
+                long long left = w->deadline > now ? w->deadline - now : 0;
+                if (wait < 0 || left < wait) wait = left;
+            }
+        }
+        if (!n) return -1;
+        if (poll(fds, P->numworkers, (int)wait) < 0) return -1;
+        if (P->timeout) now = _now();
+
+        for (DWORD i = 0; i < P->numworkers; i++) {
+            struct _WORKER *w = &P->workers[i];
+            if (fds[i].fd < 0) continue;
+            if (!fds[i].revents) {
+                /* A runaway request: kill the worker as if it had crashed */
+                if (!P->timeout || now < w->deadline) continue;
+                if (!_fail(P, i, reqs, replies)) return -1;
+                done++;
+                continue;
+            }
+            avm_Reply rep;
+            if (recv(w->fd, &rep, sizeof(rep), 0) == (ssize_t)sizeof(rep)) {
+                replies[w->job] = rep;
+                w->job = -1;
+            } else {
+                /* The worker died with the request */
+                if (!_fail(P, i, reqs, replies)) return -1;
+            }
+            done++;
+        }
+    }
+    return 0;
+}
+
+void avm_closepool(avm_Pool *P) {
+    if (!P) return;
+    /* Closing the sockets ends the recv loop of idle workers, but one stuck
+       in a guest call never gets back to it: kill whatever has not exited */
+    for (DWORD i = 0; i < P->numworkers; i++) {
+        struct _WORKER *w = &P->workers[i];
+        if (w->fd >= 0) close(w->fd);
+        w->fd = -1;
+    }
+    for (DWORD i = 0; i < P->numworkers; i++) {
+        struct _WORKER *w = &P->workers[i];
+        if (w->pid > 0 && waitpid(w->pid, NULL, WNOHANG) == w->pid) w->pid = 0;
+        _reap(w);
+    }
+    if (P->memfd >= 0) close(P->memfd);
+    free(P);
+}
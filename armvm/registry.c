@@ -0,0 +1,112 @@
+/*
+ * registry.c — host-function registry shared by states (avm_Registry).
+ *
+ * A registry maps names to avm_CFunctions and hands out call ids, starting
+ * at 1, that import slots cache.  It grows without a fixed limit and is
+ * reference counted, so any number of states can share one table instead of
+ * each carrying its own.  Names are found through an open-addressing hash
+ * of call ids keyed by fnv1a32(name).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "avm.h"
+
+avm_Registry *avm_newregistry(void) {
+    avm_Registry *R = calloc(1, sizeof(avm_Registry));
+    if (!R) return NULL;
+    R->refs = 1;
+    return R;
+}
+
+void avm_closeregistry(avm_Registry *R) {
+    if (!R || __atomic_sub_fetch(&R->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    for (DWORD i = 1; i <= R->count; i++) {
+        free(R->names[i]);
+    }
+    free(R->names);
+    free(R->fn);
+    free(R->index);
+    free(R);
+}
+
+DWORD vm_lookupfunction(const avm_Registry *R, LPCSTR name) {
+    if (!R || !R->index) return 0;
+    DWORD hash = fnv1a32(name);
+    for (DWORD i = hash & R->mask; R->index[i]; i = (i + 1) & R->mask) {
+        DWORD id = R->index[i];
+        if (!strcmp(R->names[id], name)) return id;
+    }
+    return 0;
+}
+
+static void _insertindex(DWORD *index, DWORD mask, DWORD hash, DWORD id) {
+    DWORD i = hash & mask;
+    while (index[i]) {
+        i = (i + 1) & mask;
+    }
+    index[i] = id;
+}
+
+/* Make room for one more entry: call-id arrays and a hash at most half full */
+static BOOL _grow(avm_Registry *R) {
+    if (R->count + 1 >= R->capacity) {
+        DWORD capacity = R->capacity ? R->capacity * 2 : 16;
+        avm_CFunction *fn = realloc(R->fn, capacity * sizeof(avm_CFunction));
+        if (!fn) return 0;
+        R->fn = fn;
+        char **names = realloc(R->names, capacity * sizeof(char *));
+        if (!names) return 0;
+        R->names = names;
+        R->capacity = capacity;
+    }
+    if ((R->count + 1) * 2 > R->mask + 1 || !R->index) {
+        DWORD size = R->index ? (R->mask + 1) * 2 : 32;
+        DWORD *index = calloc(size, sizeof(DWORD));
+        if (!index) return 0;
+        for (DWORD id = 1; id <= R->count; id++) {
+            _insertindex(index, size - 1, fnv1a32(R->names[id]), id);
+        }
+        free(R->index);
+        R->index = index;
+        R->mask = size - 1;
+    }
+    return 1;
+}
+
+DWORD avm_registryset(avm_Registry *R, const char *name, avm_CFunction fn) {
+    /* Re-registering a name (e.g. after avm_undump) keeps its call id */
+    DWORD id = vm_lookupfunction(R, name);
+    if (id) {
+        R->fn[id] = fn;
+        return id;
+    }
+    char *copy = strdup(name);
+    if (!copy || !_grow(R)) {
+        free(copy);
+        return 0;
+    }
+    id = ++R->count;
+    R->fn[0] = NULL;
+    R->names[0] = NULL;
+    R->fn[id] = fn;
+    R->names[id] = copy;
+    _insertindex(R->index, R->mask, fnv1a32(copy), id);
+    return id;
+}
+
+avm_Registry *avm_getregistry(avm_State *S) {
+    if (!S->registry) S->registry = avm_newregistry();
+    return S->registry;
+}
+
+void avm_setregistry(avm_State *S, avm_Registry *R) {
+    if (R) __atomic_add_fetch(&R->refs, 1, __ATOMIC_ACQ_REL);
+    avm_closeregistry(S->registry);
+    S->registry = R;
+    /* Call ids belong to the old registry; bind again by name */
+    for (DWORD i = 0; i < S->numimports; i++) {
+        S->imports[i].call_id = 0;
+    }
+}
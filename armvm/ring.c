@@ -0,0 +1,99 @@
+/*
+ * ring.c — submission/completion ring for batched host calls.
+ *
+ * A ring lives in guest heap memory so that guest code can queue requests
+ * with plain loads and stores.  The guest fills avm_RingSQE slots and bumps
+ * sq_tail; the host drains every pending slot in one go and posts an
+ * avm_RingCQE per request.  Compared to one OP_BEXT per host call the guest
+ * pays for a single transition (avm_ringsubmit) or none at all when the
+ * host drains the ring between runs with avm_drainring.
+ *
+ * Indices are free-running counters; a slot is index & (entries - 1).
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "avm.h"
+
+static BOOL _ispow2(DWORD n) {
+    return n && !(n & (n - 1));
+}
+
+DWORD avm_newring(avm_State *S, DWORD entries) {
+    if (!_ispow2(entries)) return 0;
+    size_t size = sizeof(avm_Ring) +
+                  entries * (sizeof(avm_RingSQE) + sizeof(avm_RingCQE));
+    BYTE *block = my_malloc(S, size);
+    if (!block) return 0;
+    memset(block, 0, size);
+
+    DWORD ring = (DWORD)(block - S->memory);
+    avm_Ring *r = (avm_Ring *)block;
+    r->entries = entries;
+    r->sqes = ring + sizeof(avm_Ring);
+    r->cqes = r->sqes + entries * sizeof(avm_RingSQE);
+    return ring;
+}
+
+/* True if count elements of size bytes at the word-aligned guest address
+   addr lie inside guest memory */
+static BOOL _inside(avm_State *S, DWORD addr, DWORD count, DWORD size) {
+    unsigned long long memsize = (unsigned long long)S->progsize + S->stacksize + S->heapsize;
+    return !(addr & 3) && addr <= memsize && (unsigned long long)count * size <= memsize - addr;
+}
+
+int avm_drainring(avm_State *S, DWORD ring) {
+    /* The header is guest memory, so check it on every drain: a bad ring
+       faults the run rather than reaching host memory */
+    if (!_inside(S, ring, 1, sizeof(avm_Ring))) goto fault;
+    avm_Ring *r = (avm_Ring *)(S->memory + ring);
+    DWORD entries = r->entries, sqaddr = r->sqes, cqaddr = r->cqes;
+    if (!_ispow2(entries) ||
+        !_inside(S, sqaddr, entries, sizeof(avm_RingSQE)) ||
+        !_inside(S, cqaddr, entries, sizeof(avm_RingCQE)))
+        goto fault;
+    avm_RingSQE *sqes = (avm_RingSQE *)(S->memory + sqaddr);
+    avm_RingCQE *cqes = (avm_RingCQE *)(S->memory + cqaddr);
+    DWORD mask = entries - 1;
+
+    DWORD saved[4];
+    memcpy(saved, S->r, sizeof(saved));
+
+    DWORD sq_head = r->sq_head;
+    DWORD sq_tail = __atomic_load_n(&r->sq_tail, __ATOMIC_ACQUIRE);
+    DWORD cq_tail = r->cq_tail;
+    int done = 0;
+    while (sq_head != sq_tail) {
+        /* Stop when the guest has not reaped enough completions yet */
+        if (cq_tail - __atomic_load_n(&r->cq_head, __ATOMIC_ACQUIRE) > mask)
+            break;
+        avm_RingSQE *sqe = &sqes[sq_head & mask];
+        memcpy(S->r, sqe->args, sizeof(sqe->args));
+        avm_RingCQE *cqe = &cqes[cq_tail & mask];
+        cqe->user_data = sqe->user_data;
+        cqe->result = S->syscall(S, sqe->func);
+        sq_head++;
+        cq_tail++;
+        done++;
+    }
+
+    __atomic_store_n(&r->sq_head, sq_head, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->cq_tail, cq_tail, __ATOMIC_RELEASE);
+    memcpy(S->r, saved, sizeof(saved));
+    return done;
+
+fault:
+    fprintf(stderr, "VM: ring 0x%x outside guest memory\n", ring);
+    vm_halt(S, AVM_FAULT);
+    return -1;
+}
+
+int avm_ringsubmit(avm_State *S) {
+    avm_pushinteger(S, avm_drainring(S, avm_touinteger(S, 1)));
+    return 1;
+}
+
+DWORD avm_callid(avm_State *S, const char *name) {
+    return vm_lookupfunction(S->registry, name);
+}
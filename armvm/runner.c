@@ -0,0 +1,684 @@
+/*
+ * runner.c — armvm-run, a standalone runner for guest programs.
+ *
+ * Loads an ORCA image written by armvm-compiler, or assembles a .s file,
+ * registers the standard host library (avm_openlibs) and calls _main (or
+ * --entry NAME).  Meant for benchmarking guest code without writing a host
+ * program:
+ *
+ *   armvm-run --repeat 100 --threads 4 --stats bench.s
+ *
+ * --threads N runs N independent states in parallel, each --repeat times;
+ * they share one function registry.  --stats and --profile switch the
+ * states to the counting loop (avm_setstats); without them the program runs
+ * at full speed and only the wall time is measured.  Reports go to stderr
+ * so they do not mix with the guest's output.
+ *
+ * --filter NAME turns the runner into a record pipeline instead: see the
+ * "Record pipeline" section below.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "avm.h"
+
+#define PROFILE_TOP 16
+#define PIPE_BATCH 4096             /* records per batch */
+#define PIPE_OUTSIZE (1 << 20)      /* output bytes per batch */
+
+struct _OPTIONS {
+    unsigned long repeat;
+    unsigned long long budget;
+    unsigned long threads;
+    BOOL stats;
+    BOOL profile;
+    const char *entry;
+    DWORD stacksize;
+    DWORD heapsize;
+    DWORD stacklimit;   /* growth limits, 0 for fixed sizes */
+    DWORD heaplimit;
+    /* Record pipeline */
+    const char *filter;
+    const char *input;
+    const char *output;
+    DWORD recordsize;   /* fixed record size, 0 for length-prefixed records */
+    BOOL prefixed;
+    BOOL perbatch;
+    DWORD batch;
+    DWORD outsize;
+};
+
+struct _JOB {
+    avm_State *S;
+    const struct _OPTIONS *opt;
+    DWORD entry;
+    avm_Stats stats;
+    unsigned long runs;
+    int status;
+    pthread_t tid;
+    struct _PIPELINE *pipe;
+    DWORD *outbase;     /* guest address of each output slot */
+};
+
+static double _now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char *_readfile(const char *path, size_t *len) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *buf = size >= 0 ? malloc((size_t)size + 1) : NULL;
+    if (buf && size && fread(buf, (size_t)size, 1, fp) != 1) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(fp);
+    if (!buf) return NULL;
+    buf[size] = '\0';
+    *len = (size_t)size;
+    return buf;
+}
+
+/* Load an ORCA image or assembly source; ORCA images start with the magic */
+static int _load(avm_State *S, const char *file, size_t len) {
+    DWORD magic = 0;
+    if (len >= sizeof(magic)) memcpy(&magic, file, sizeof(magic));
+    if (magic == ID_ORCA)
+        return avm_loadimage(S, file, len);
+    return avm_loadbuffer(S, file, len);
+}
+
+static void *_run(void *arg) {
+    struct _JOB *job = arg;
+    const struct _OPTIONS *opt = job->opt;
+    job->status = AVM_OK;
+    for (job->runs = 0; job->runs < opt->repeat; ) {
+        if (opt->budget)
+            job->stats.budget = job->stats.instructions + opt->budget;
+        job->status = avm_call(job->S, job->entry);
+        job->runs++;
+        if (job->status != AVM_OK) break;
+    }
+    return NULL;
+}
+
+static const char *_symbol(avm_State *S, DWORD addr, DWORD *offset) {
+    const struct _EXPORT *best = NULL;
+    for (DWORD i = 0; S->exports && i <= S->exportmask; i++) {
+        const struct _EXPORT *e = &S->exports[i];
+        if (e->name && !e->size && e->position <= addr &&
+            (!best || e->position > best->position))
+            best = e;
+    }
+    *offset = best ? addr - best->position : addr;
+    return best ? best->name : "";
+}
+
+static void _report(struct _JOB *jobs, const struct _OPTIONS *opt, double elapsed) {
+    avm_State *S = jobs[0].S;
+    const avm_Registry *R = S->registry;
+    unsigned long long instructions = 0, hostcalls = 0, runs = 0;
+    for (unsigned long t = 0; t < opt->threads; t++) {
+        instructions += jobs[t].stats.instructions;
+        hostcalls += jobs[t].stats.hostcalls;
+        runs += jobs[t].runs;
+    }
+    if (runs) {
+        fprintf(stderr, "runs          %llu (%lu thread%s)\n", runs, opt->threads,
+                opt->threads == 1 ? "" : "s");
+        fprintf(stderr, "wall time     %.6f s (%.3f ms per run)\n", elapsed,
+                elapsed * 1e3 * opt->threads / runs);
+    }
+    fprintf(stderr, "instructions  %llu (%.2f M/s)\n", instructions,
+            elapsed > 0 ? instructions / elapsed * 1e-6 : 0.0);
+    fprintf(stderr, "host calls    %llu\n", hostcalls);
+    for (DWORD id = 1; R && id <= R->count; id++) {
+        unsigned long long calls = 0;
+        for (unsigned long t = 0; t < opt->threads; t++) {
+            calls += jobs[t].stats.calls[id];
+        }
+        if (calls) fprintf(stderr, "  %-24s %llu\n", R->names[id], calls);
+    }
+    /* Memory of the first state, to size --stack and --heap */
+    avm_MemStats mem;
+    avm_memstats(S, &mem);
+    fprintf(stderr, "stack used    %u of %u bytes\n", mem.stackused, mem.stacksize);
+    fprintf(stderr, "heap          %u in use, %u free in %u blocks (largest %u)\n",
+            mem.inuse, mem.free, mem.freeblocks, mem.largestfree);
+    fprintf(stderr, "heap calls    %llu allocs, %llu frees\n", mem.allocs, mem.frees);
+    if (!opt->profile || !instructions) return;
+
+    /* Sum the per-word counts into the first job and list the hottest */
+    DWORD words = S->progsize / sizeof(DWORD);
+    unsigned long long *profile = jobs[0].stats.profile;
+    for (unsigned long t = 1; t < opt->threads; t++) {
+        for (DWORD w = 0; w < words; w++) {
+            profile[w] += jobs[t].stats.profile[w];
+        }
+    }
+    fprintf(stderr, "hottest instructions\n");
+    for (int n = 0; n < PROFILE_TOP; n++) {
+        DWORD top = 0;
+        for (DWORD w = 1; w < words; w++) {
+            if (profile[w] > profile[top]) top = w;
+        }
+        if (!profile[top]) break;
+        DWORD addr = top * (DWORD)sizeof(DWORD), offset;
+        const char *name = _symbol(S, addr, &offset);
+        fprintf(stderr, "  0x%06x %08x %12llu %6.2f%%  %s+0x%x\n", addr,
+                *(DWORD *)(S->memory + addr), profile[top],
+                profile[top] * 100.0 / instructions, name, offset);
+        profile[top] = 0;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Record pipeline (--filter NAME).
+ *
+ * The input file is memory-mapped once.  A worker maps the bytes of each
+ * batch it claims read-only into its state (avm_mapbuffer) and unmaps them
+ * afterwards, so guest code reads records where they lie in the page cache;
+ * nothing is copied per record.  The input can be of any size, but one
+ * batch must fit in a state's region space (MAX_BATCH_BYTES).  Records are
+ * either --record N bytes each or --prefixed with a 4-byte little-endian
+ * length.
+ *
+ * Records are grouped into batches of --batch records.  Workers claim
+ * batches in order and call the filter
+ *
+ *   int NAME(const void *record, DWORD len, void *out, DWORD space)
+ *
+ * once per record, or with --per-batch once per batch as
+ *
+ *   int NAME(const void *records, DWORD count, void *out, DWORD space)
+ *
+ * where records points at the first record of the batch, laid out as in the
+ * file.  The filter writes its output at out and returns the number of bytes
+ * written (0 drops the record); a negative value or more than space stops
+ * the pipeline.
+ *
+ * Each batch fills one of a window of host output slots, which are mapped
+ * into every state too.  The main thread writes finished slots to the
+ * output file in batch order, one write per batch, and hands the slot back;
+ * a worker never runs more than a window ahead of the writer.
+ * --------------------------------------------------------------------------- */
+
+#define MAX_BATCH_BYTES (VM_REGION_BASE / 2)
+
+struct _SLOT {
+    BYTE *out;
+    DWORD used;
+    BOOL ready;
+};
+
+struct _PIPELINE {
+    const struct _OPTIONS *opt;
+    const BYTE *input;
+    size_t inputsize;
+    size_t *batches;    /* input offset of each batch, plus the end */
+    DWORD numbatches;
+    unsigned long long numrecords;
+    struct _SLOT *slots;
+    DWORD window;
+    DWORD next;         /* next batch to claim */
+    DWORD written;      /* batches written so far */
+    int error;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static DWORD _le32(const BYTE *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (DWORD)p[3] << 24;
+}
+
+/* Split the input into batches of opt->batch records; returns 0, or -1 for
+   a truncated record and -2 for a batch over MAX_BATCH_BYTES */
+static int _index(struct _PIPELINE *P) {
+    const struct _OPTIONS *opt = P->opt;
+    unsigned long long records = 0;
+    size_t capacity = 0, off = 0;
+    while (off < P->inputsize) {
+        DWORD len = opt->recordsize;
+        size_t data = off;
+        if (opt->prefixed) {
+            if (P->inputsize - off < 4) return -1;
+            len = _le32(P->input + off);
+            data += 4;
+        }
+        if (P->inputsize - data < len) return -1;
+        if (records % opt->batch == 0) {
+            if (P->numbatches + 1 >= capacity) {
+                capacity = capacity ? capacity * 2 : 1024;
+                size_t *batches = realloc(P->batches, capacity * sizeof(size_t));
+                if (!batches) return -1;
+                P->batches = batches;
+            }
+            P->batches[P->numbatches++] = off;
+        }
+        records++;
+        off = data + len;
+        if (off - P->batches[P->numbatches - 1] > MAX_BATCH_BYTES) return -2;
+    }
+    if (!P->batches && !(P->batches = malloc(sizeof(size_t)))) return -1;
+    P->batches[P->numbatches] = off;
+    P->numrecords = records;
+    return 0;
+}
+
+static int _filterbatch(struct _JOB *job, DWORD b, struct _SLOT *slot, DWORD outbase) {
+    struct _PIPELINE *P = job->pipe;
+    const struct _OPTIONS *opt = P->opt;
+    avm_State *S = job->S;
+    const BYTE *batch = P->input + P->batches[b];
+    DWORD off = 0, end = (DWORD)(P->batches[b + 1] - P->batches[b]);
+    slot->used = 0;
+    if (!end) return AVM_OK;
+    /* Only this batch is visible to the state, at a base of its own */
+    DWORD inbase = avm_mapbuffer(S, (void *)batch, end, AVM_MAP_READ);
+    if (!inbase) return AVM_FAULT;
+    int status = AVM_OK;
+    while (off < end) {
+        DWORD args[4], next;
+        if (opt->perbatch) {
+            BOOL last = b + 1 == P->numbatches;
+            args[0] = inbase;
+            args[1] = last ? (DWORD)(P->numrecords - (unsigned long long)b * opt->batch) : opt->batch;
+            next = end;
+        } else {
+            DWORD len = opt->prefixed ? _le32(batch + off) : opt->recordsize;
+            DWORD data = opt->prefixed ? off + 4 : off;
+            args[0] = inbase + data;
+            args[1] = len;
+            next = data + len;
+        }
+        args[2] = outbase + slot->used;
+        args[3] = opt->outsize - slot->used;
+        status = avm_callnested(S, job->entry, 4, args);
+        if (status != AVM_OK) break;
+        int n = avm_tointeger(S, 1);
+        if (n < 0 || (DWORD)n > args[3]) {
+            fprintf(stderr, "armvm-run: %s returned %d with %u bytes of space\n",
+                    opt->filter, n, args[3]);
+            status = AVM_FAULT;
+            break;
+        }
+        slot->used += (DWORD)n;
+        off = next;
+    }
+    avm_unmap(S, inbase);
+    return status;
+}
+
+static void *_worker(void *arg) {
+    struct _JOB *job = arg;
+    struct _PIPELINE *P = job->pipe;
+    job->status = AVM_OK;
+    for (;;) {
+        pthread_mutex_lock(&P->lock);
+        while (!P->error && P->next < P->numbatches && P->next >= P->written + P->window)
+            pthread_cond_wait(&P->cond, &P->lock);
+        if (P->error || P->next >= P->numbatches) {
+            pthread_mutex_unlock(&P->lock);
+            return NULL;
+        }
+        DWORD b = P->next++;
+        pthread_mutex_unlock(&P->lock);
+
+        struct _SLOT *slot = &P->slots[b % P->window];
+        int status = _filterbatch(job, b, slot, job->outbase[b % P->window]);
+
+        pthread_mutex_lock(&P->lock);
+        if (status != AVM_OK) {
+            job->status = status;
+            P->error = 1;
+        }
+        slot->ready = 1;
+        pthread_cond_broadcast(&P->cond);
+        pthread_mutex_unlock(&P->lock);
+    }
+}
+
+/* Write finished batches in order; returns 0 or -1 */
+static int _writer(struct _PIPELINE *P, int fd, unsigned long long *outbytes) {
+    for (DWORD b = 0; b < P->numbatches; b++) {
+        struct _SLOT *slot = &P->slots[b % P->window];
+        pthread_mutex_lock(&P->lock);
+        while (!P->error && !slot->ready)
+            pthread_cond_wait(&P->cond, &P->lock);
+        int error = P->error;
+        pthread_mutex_unlock(&P->lock);
+        if (error) return -1;
+
+        for (DWORD done = 0; done < slot->used; ) {
+            ssize_t n = write(fd, slot->out + done, slot->used - done);
+            if (n <= 0) {
+                perror("armvm-run: write");
+                pthread_mutex_lock(&P->lock);
+                P->error = 1;
+                pthread_cond_broadcast(&P->cond);
+                pthread_mutex_unlock(&P->lock);
+                return -1;
+            }
+            done += (DWORD)n;
+        }
+        *outbytes += slot->used;
+
+        pthread_mutex_lock(&P->lock);
+        slot->ready = 0;
+        P->written++;
+        pthread_cond_broadcast(&P->cond);
+        pthread_mutex_unlock(&P->lock);
+    }
+    return 0;
+}
+
+static int _pipeline(struct _JOB *jobs, const struct _OPTIONS *opt) {
+    struct _PIPELINE P = {
+        .opt = opt,
+        .window = 2 * (DWORD)opt->threads,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+    int rc = 1, in = -1, out = -1;
+    unsigned long long outbytes = 0;
+    struct stat st;
+
+    in = open(opt->input, O_RDONLY);
+    if (in < 0 || fstat(in, &st) != 0) {
+        fprintf(stderr, "armvm-run: cannot read %s\n", opt->input);
+        goto done;
+    }
+    P.inputsize = (size_t)st.st_size;
+    if (P.inputsize) {
+        void *input = mmap(NULL, P.inputsize, PROT_READ, MAP_PRIVATE, in, 0);
+        if (input == MAP_FAILED) {
+            perror("armvm-run: mmap");
+            goto done;
+        }
+        madvise(input, P.inputsize, MADV_SEQUENTIAL);
+        P.input = input;
+    }
+    switch (_index(&P)) {
+    case 0:
+        break;
+    case -2:
+        fprintf(stderr, "armvm-run: a batch of %s is over %u bytes; lower --batch\n",
+                opt->input, MAX_BATCH_BYTES);
+        goto done;
+    default:
+        fprintf(stderr, "armvm-run: %s ends in a truncated record\n", opt->input);
+        goto done;
+    }
+
+    P.slots = calloc(P.window, sizeof(struct _SLOT));
+    for (DWORD i = 0; P.slots && i < P.window; i++) {
+        if (!(P.slots[i].out = malloc(opt->outsize))) goto done;
+    }
+    if (!P.slots) goto done;
+    for (unsigned long t = 0; t < opt->threads; t++) {
+        struct _JOB *job = &jobs[t];
+        job->pipe = &P;
+        job->outbase = calloc(P.window, sizeof(DWORD));
+        if (!job->outbase) goto done;
+        for (DWORD i = 0; i < P.window; i++) {
+            if (!(job->outbase[i] = avm_mapbuffer(job->S, P.slots[i].out, opt->outsize, AVM_MAP_WRITE)))
+                goto done;
+        }
+    }
+
+    out = open(opt->output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        fprintf(stderr, "armvm-run: cannot write %s\n", opt->output);
+        goto done;
+    }
+
+    double start = _now();
+    for (unsigned long t = 0; t < opt->threads; t++) {
+        pthread_create(&jobs[t].tid, NULL, _worker, &jobs[t]);
+    }
+    rc = _writer(&P, out, &outbytes) == 0 ? 0 : 1;
+    for (unsigned long t = 0; t < opt->threads; t++) {
+        pthread_join(jobs[t].tid, NULL);
+    }
+    double elapsed = _now() - start;
+
+    for (unsigned long t = 0; t < opt->threads; t++) {
+        if (jobs[t].status != AVM_OK)
+            fprintf(stderr, "armvm-run: %s stopped with status %d\n", opt->filter, jobs[t].status);
+    }
+    if (opt->stats || opt->profile) {
+        fprintf(stderr, "records       %llu in %u batches (%lu thread%s)\n", P.numrecords,
+                P.numbatches, opt->threads, opt->threads == 1 ? "" : "s");
+        fprintf(stderr, "wall time     %.6f s (%.2f M records/s)\n", elapsed,
+                elapsed > 0 ? P.numrecords / elapsed * 1e-6 : 0.0);
+        fprintf(stderr, "bytes         %zu in, %llu out (%.1f MB/s in)\n", P.inputsize,
+                outbytes, elapsed > 0 ? P.inputsize / elapsed * 1e-6 : 0.0);
+        _report(jobs, opt, elapsed);
+    }
+
+done:
+    /* States keep the buffers mapped; the caller closes them afterwards */
+    if (out >= 0 && close(out) != 0) rc = 1;
+    if (rc && out >= 0) unlink(opt->output);
+    for (unsigned long t = 0; t < opt->threads; t++) {
+        free(jobs[t].outbase);
+        jobs[t].outbase = NULL;
+    }
+    for (unsigned long t = 0; t < opt->threads; t++) {
+        if (jobs[t].S) {
+            avm_close(jobs[t].S);
+            jobs[t].S = NULL;
+        }
+    }
+    for (DWORD i = 0; P.slots && i < P.window; i++) {
+        free(P.slots[i].out);
+    }
+    free(P.slots);
+    free(P.batches);
+    if (P.input) munmap((void *)P.input, P.inputsize);
+    if (in >= 0) close(in);
+    return rc;
+}
+
+static void _usage(void) {
+    fprintf(stderr,
+            "usage: armvm-run [options] program.s|image\n"
+            "  --repeat N     call the entry point N times (default 1)\n"
+            "  --budget N     stop a run after N instructions\n"
+            "  --threads N    run N states in parallel (default 1)\n"
+            "  --stats        report instructions per second and host calls\n"
+            "  --profile      report the most executed instructions\n"
+            "  --entry NAME   call exported function NAME instead of _main\n"
+            "  --stack N      stack size in bytes\n"
+            "  --heap N       heap size in bytes\n"
+            "  --heap-limit N let the heap grow from --heap up to N bytes, with\n"
+            "                 the stack reserved up to --stack-limit N\n"
+            "record pipeline:\n"
+            "  --filter NAME  call exported function NAME per record\n"
+            "  --input FILE   records to read (memory-mapped)\n"
+            "  --output FILE  where the filter output is written, in input order\n"
+            "  --record N     records of N bytes\n"
+            "  --prefixed     records with a 4-byte little-endian length prefix\n"
+            "  --batch N      records per batch (default 4096, at most 1 GiB each)\n"
+            "  --per-batch    call NAME once per batch instead of per record\n"
+            "  --out-size N   output bytes per batch (default 1 MiB)\n");
+}
+
+int main(int argc, const char *argv[]) {
+    struct _OPTIONS opt = {
+        .repeat = 1,
+        .threads = 1,
+        .stacksize = VM_STACK_SIZE,
+        .heapsize = VM_HEAP_SIZE,
+        .batch = PIPE_BATCH,
+        .outsize = PIPE_OUTSIZE,
+    };
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!strcmp(arg, "--stats")) {
+            opt.stats = 1;
+        } else if (!strcmp(arg, "--profile")) {
+            opt.profile = 1;
+        } else if (!strcmp(arg, "--prefixed")) {
+            opt.prefixed = 1;
+        } else if (!strcmp(arg, "--per-batch")) {
+            opt.perbatch = 1;
+        } else if (*arg == '-' && !value) {
+            _usage();
+            return 2;
+        } else if (!strcmp(arg, "--repeat")) {
+            opt.repeat = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(arg, "--budget")) {
+            opt.budget = strtoull(argv[++i], NULL, 0);
+        } else if (!strcmp(arg, "--threads")) {
+            opt.threads = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(arg, "--entry")) {
+            opt.entry = argv[++i];
+        } else if (!strcmp(arg, "--stack")) {
+            opt.stacksize = (DWORD)strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(arg, "--heap")) {
+            opt.heapsize = (DWORD)strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(arg, "--heap-limit")) {
+            opt.heaplimit = (DWORD)strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(arg, "--stack-limit")) {
+            opt.stacklimit = (DWORD)strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(arg, "--filter")) {
+            opt.filter = argv[++i];
+        } else if (!strcmp(arg, "--input")) {
+            opt.input = argv[++i];
+        } else if (!strcmp(arg, "--output")) {
+            opt.output = argv[++i];
+        } else if (!strcmp(arg, "--record")) {
+            opt.recordsize = (DWORD)strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(arg, "--batch")) {
+            opt.batch = (DWORD)strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(arg, "--out-size")) {
+            opt.outsize = (DWORD)strtoul(argv[++i], NULL, 0);
+        } else if (*arg == '-' || path) {
+            _usage();
+            return 2;
+        } else {
+            path = arg;
+        }
+    }
+    if (!path || !opt.repeat || !opt.threads) {
+        _usage();
+        return 2;
+    }
+    if (opt.filter && (!opt.input || !opt.output || !opt.batch || !opt.outsize ||
+                       !opt.recordsize == !opt.prefixed)) {
+        fprintf(stderr, "armvm-run: --filter needs --input, --output and one of --record or --prefixed\n");
+        return 2;
+    }
+    if (opt.filter)
+        opt.entry = opt.filter;
+
+    size_t len;
+    char *file = _readfile(path, &len);
+    if (!file) {
+        fprintf(stderr, "armvm-run: cannot read %s\n", path);
+        return 1;
+    }
+
+    /* States are loaded one after another: the assembler is not reentrant */
+    struct _JOB *jobs = calloc(opt.threads, sizeof(struct _JOB));
+    BOOL counting = opt.stats || opt.profile || opt.budget;
+    int rc = 1;
+    if (!jobs) {
+        free(file);
+        return 1;
+    }
+    for (unsigned long t = 0; t < opt.threads; t++) {
+        struct _JOB *job = &jobs[t];
+        job->opt = &opt;
+        job->S = avm_newstate(opt.stacksize, opt.heapsize);
+        if (!job->S) goto done;
+        if ((opt.heaplimit || opt.stacklimit) &&
+            avm_setlimits(job->S, opt.stacklimit ? opt.stacklimit : opt.stacksize,
+                          opt.heaplimit ? opt.heaplimit : opt.heapsize) != 0) {
+            fprintf(stderr, "armvm-run: stack and heap limits too large\n");
+            goto done;
+        }
+        if (t == 0)
+            avm_openlibs(job->S);
+        else
+            avm_setregistry(job->S, jobs[0].S->registry);
+        if (_load(job->S, file, len) != 0) {
+            fprintf(stderr, "armvm-run: cannot load %s\n", path);
+            goto done;
+        }
+        job->entry = opt.entry ? avm_getfunction(job->S, opt.entry) : job->S->entry_point;
+        if (job->entry == AVM_NOFUNCTION) {
+            fprintf(stderr, "armvm-run: no exported function %s\n", opt.entry);
+            goto done;
+        }
+        if (counting) {
+            job->stats.numcalls = job->S->registry->count + 1;
+            job->stats.calls = calloc(job->stats.numcalls, sizeof(unsigned long long));
+            if (opt.profile)
+                job->stats.profile = calloc(job->S->progsize / sizeof(DWORD),
+                                            sizeof(unsigned long long));
+            job->stats.budget = opt.budget;
+            avm_setstats(job->S, &job->stats);
+        }
+    }
+
+    if (opt.filter) {
+        rc = _pipeline(jobs, &opt);
+        goto done;
+    }
+
+    double start = _now();
+    if (opt.threads == 1) {
+        _run(&jobs[0]);
+    } else {
+        for (unsigned long t = 0; t < opt.threads; t++) {
+            pthread_create(&jobs[t].tid, NULL, _run, &jobs[t]);
+        }
+        for (unsigned long t = 0; t < opt.threads; t++) {
+            pthread_join(jobs[t].tid, NULL);
+        }
+    }
+    double elapsed = _now() - start;
+
+    rc = 0;
+    for (unsigned long t = 0; t < opt.threads; t++) {
+        if (jobs[t].status == AVM_INTERRUPTED && opt.budget) {
+            fprintf(stderr, "armvm-run: budget of %llu instructions exhausted\n", opt.budget);
+            rc = 3;
+        } else if (jobs[t].status != AVM_OK) {
+            fprintf(stderr, "armvm-run: run stopped with status %d\n", jobs[t].status);
+            rc = 1;
+        }
+    }
+    if (opt.stats || opt.profile)
+        _report(jobs, &opt, elapsed);
+    if (!rc)
+        rc = avm_tointeger(jobs[0].S, 1) & 0xff;
+
+done:
+    for (unsigned long t = 0; t < opt.threads; t++) {
+        if (jobs[t].S) avm_close(jobs[t].S);
+        free(jobs[t].stats.calls);
+        free(jobs[t].stats.profile);
+    }
+    free(jobs);
+    free(file);
+    return rc;
+}
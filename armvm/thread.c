@@ -0,0 +1,279 @@
+/*
+ * thread.c — guest threads sharing one guest image (avm_newthread) and a
+ * futex-like wait/wake primitive for them.
+ *
+ * A thread is a struct VM of its own — registers, CPSR, exclusive monitor,
+ * status — whose memory, registered functions and import slots are those of
+ * the state it was created from.  Its stack is a block of the shared guest
+ * heap, so guest pointers mean the same thing on every thread.  Each thread
+ * runs on whatever host thread calls into it; avm_threadspawn gives guests
+ * a pthread per thread.
+ *
+ * Guest code synchronises with ldrex/strex/dmb (see exec_exclusive) and
+ * sleeps with futex_wait/futex_wake.  The futex keeps a small hash table of
+ * wait queues keyed by host address, so it works across states too.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "avm.h"
+
+struct _THREADS {
+    pthread_mutex_t heaplock;
+    pthread_mutex_t lock;
+    LPVM spawned[AVM_MAX_THREADS];    /* avm_threadspawn threads by tid - 1 */
+    pthread_t handles[AVM_MAX_THREADS];
+};
+
+void vm_lockheap(LPVM vm) {
+    pthread_mutex_lock(&vm->threads->heaplock);
+}
+
+void vm_unlockheap(LPVM vm) {
+    pthread_mutex_unlock(&vm->threads->heaplock);
+}
+
+avm_State *avm_newthread(avm_State *S, DWORD stacksize) {
+    if (S->parent) S = S->parent;
+    if (!S->memory) return NULL;
+    if (!S->threads) {
+        struct _THREADS *threads = calloc(1, sizeof(struct _THREADS));
+        if (!threads) return NULL;
+        pthread_mutex_init(&threads->heaplock, NULL);
+        pthread_mutex_init(&threads->lock, NULL);
+        S->threads = threads;
+    }
+
+    /* Threads share the parent's registry, so make sure there is one */
+    if (!avm_getregistry(S)) return NULL;
+    LPVM T = vm_alloc();
+    if (!T) return NULL;
+    stacksize = (stacksize + 7) & ~7u;
+    BYTE *stack = my_malloc(S, stacksize);
+    if (!stack) {
+        free(T);
+        return NULL;
+    }
+
+    /* Share everything that describes the image, reset everything that
+       describes execution */
+    memcpy(T, S, sizeof(struct VM));
+    memset(T->r, 0, sizeof(T->r));
+    T->cpsr = 0;
+    T->location = T->progsize;
+    T->interrupt = 0;
+    T->status = AVM_OK;
+    T->resume = 0;
+    T->depth = 0;
+    T->running = 0;
+    T->stats = NULL;
+    T->exclusive = 0;
+    T->fiber = 0;
+    T->fibermain = 0;
+    T->mapping = NULL;
+    T->mapsize = 0;
+    T->journal = NULL;
+    T->shadow = NULL;
+    T->shadowsize = 0;
+    if (S->journal) T->syscall = S->journaled;
+    T->journaled = NULL;
+    T->parent = S;
+    T->stackblock = (DWORD)(stack - S->memory);
+    T->r[SP_REG] = T->stackblock + stacksize;
+    T->stacktop = T->splow = T->r[SP_REG];
+    return T;
+}
+
+/* Release a thread created by avm_newthread (called from avm_close) */
+static void _freethread(LPVM T) {
+    if (T->fibermain) my_free(T->parent, T->parent->memory + T->fibermain);
+    my_free(T->parent, T->parent->memory + T->stackblock);
+    free(T);
+}
+
+/* Join and release every spawned thread, then the shared block itself */
+void vm_closethreads(LPVM vm) {
+    if (vm->parent) {
+        _freethread(vm);
+        return;
+    }
+    struct _THREADS *threads = vm->threads;
+    if (!threads) return;
+    for (DWORD i = 0; i < AVM_MAX_THREADS; i++) {
+        if (threads->spawned[i]) {
+            pthread_join(threads->handles[i], NULL);
+            _freethread(threads->spawned[i]);
+        }
+    }
+    pthread_mutex_destroy(&threads->heaplock);
+    pthread_mutex_destroy(&threads->lock);
+    free(threads);
+    vm->threads = NULL;
+}
+
+/* Guest-facing thread functions ------------------------------------------ */
+
+static void *_threadmain(void *arg) {
+    LPVM T = arg;
+    avm_pcall(T, T->r[0], 1, T->r[1]);
+    return NULL;
+}
+
+int avm_threadspawn(avm_State *S) {
+    DWORD fn = avm_touinteger(S, 1), arg = avm_touinteger(S, 2);
+    LPVM T = avm_newthread(S, AVM_THREAD_STACK);
+    if (!T) {
+        avm_pushinteger(S, 0);
+        return 1;
+    }
+    struct _THREADS *threads = T->threads;
+    pthread_mutex_lock(&threads->lock);
+    DWORD tid = 0;
+    for (DWORD i = 0; i < AVM_MAX_THREADS && !tid; i++) {
+        if (!threads->spawned[i]) tid = i + 1;
+    }
+    T->r[0] = fn;
+    T->r[1] = arg;
+    if (tid && pthread_create(&threads->handles[tid - 1], NULL, _threadmain, T) == 0) {
+        threads->spawned[tid - 1] = T;
+    } else {
+        tid = 0;
+    }
+    pthread_mutex_unlock(&threads->lock);
+    if (!tid) avm_close(T);
+    avm_pushinteger(S, (int)tid);
+    return 1;
+}
+
+int avm_threadjoin(avm_State *S) {
+    DWORD tid = avm_touinteger(S, 1);
+    struct _THREADS *threads = S->threads;
+    if (!threads || tid == 0 || tid > AVM_MAX_THREADS) {
+        avm_pushinteger(S, -1);
+        return 1;
+    }
+    pthread_mutex_lock(&threads->lock);
+    LPVM T = threads->spawned[tid - 1];
+    pthread_t handle = threads->handles[tid - 1];
+    threads->spawned[tid - 1] = NULL;
+    pthread_mutex_unlock(&threads->lock);
+    if (!T) {
+        avm_pushinteger(S, -1);
+        return 1;
+    }
+    pthread_join(handle, NULL);
+    DWORD result = T->r[0];
+    avm_close(T);
+    avm_pushinteger(S, (int)result);
+    return 1;
+}
+
+/* Futex ------------------------------------------------------------------- */
+
+#define FUTEX_BUCKETS 64
+
+struct _WAITER {
+    const DWORD *key;
+    pthread_cond_t cond;
+    BOOL woken;
+    struct _WAITER *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct _WAITER *waiters;
+} _futex[FUTEX_BUCKETS] = {
+    [0 ... FUTEX_BUCKETS - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL }
+};
+
+static DWORD _bucket(const DWORD *key) {
+    return (DWORD)(((size_t)key >> 2) * 0x9e3779b1u) % FUTEX_BUCKETS;
+}
+
+/* Host address of the futex word at the guest address in r0; NULL after
+   halting the run with AVM_FAULT if the word is unaligned or not all of it
+   is guest or mapped memory */
+static const DWORD *_futexkey(avm_State *S) {
+    DWORD addr = avm_touinteger(S, 1);
+    if (addr & 3) {
+        fprintf(stderr, "VM: futex word 0x%x is not aligned\n", addr);
+        vm_halt(S, AVM_FAULT);
+        return NULL;
+    }
+    const BYTE *p = avm_checkpointer(S, addr);
+    if (!p || avm_checkpointer(S, addr + 3) != p + 3) return NULL;
+    return (const DWORD *)p;
+}
+
+int avm_futexwait(avm_State *S) {
+    const DWORD *key = _futexkey(S);
+    if (!key) return 0;
+    DWORD expected = avm_touinteger(S, 2);
+    DWORD timeout = avm_touinteger(S, 3);
+    DWORD b = _bucket(key);
+
+    struct timespec deadline;
+    if (timeout) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(&_futex[b].lock);
+    /* Checked under the bucket lock, so a wake after the store cannot be lost */
+    if (__atomic_load_n(key, __ATOMIC_SEQ_CST) != expected) {
+        pthread_mutex_unlock(&_futex[b].lock);
+        avm_pushinteger(S, AVM_FUTEX_CHANGED);
+        return 1;
+    }
+    struct _WAITER w = { .key = key, .next = _futex[b].waiters };
+    pthread_cond_init(&w.cond, NULL);
+    _futex[b].waiters = &w;
+    while (!w.woken) {
+        int rc = timeout ? pthread_cond_timedwait(&w.cond, &_futex[b].lock, &deadline)
+                         : pthread_cond_wait(&w.cond, &_futex[b].lock);
+        if (rc == ETIMEDOUT) break;
+    }
+    if (!w.woken) {
+        struct _WAITER **p = &_futex[b].waiters;
+        while (*p != &w) p = &(*p)->next;
+        *p = w.next;
+    }
+    pthread_mutex_unlock(&_futex[b].lock);
+    pthread_cond_destroy(&w.cond);
+    avm_pushinteger(S, w.woken ? AVM_FUTEX_WOKEN : AVM_FUTEX_TIMEDOUT);
+    return 1;
+}
+
+int avm_futexwake(avm_State *S) {
+    const DWORD *key = _futexkey(S);
+    if (!key) return 0;
+    DWORD count = avm_touinteger(S, 2);
+    DWORD b = _bucket(key);
+    int woken = 0;
+
+    pthread_mutex_lock(&_futex[b].lock);
+    for (struct _WAITER **p = &_futex[b].waiters; *p && (DWORD)woken < count;) {
+        struct _WAITER *w = *p;
+        if (w->key != key) {
+            p = &w->next;
+            continue;
+        }
+        *p = w->next;
+        w->woken = 1;
+        pthread_cond_signal(&w->cond);
+        woken++;
+    }
+    pthread_mutex_unlock(&_futex[b].lock);
+    avm_pushinteger(S, woken);
+    return 1;
+}
@@ -12,13 +12,6 @@ typedef unsigned int DWORD;
 typedef unsigned char BYTE;
 typedef unsigned short WORD;
 
-/*
- * Size of the C function table used by avm_register.
- * Index 0 is reserved/unused by convention, so the maximum number of
- * functions that can actually be registered is AVM_MAX_CFUNCTIONS - 1.
- */
-#define AVM_MAX_CFUNCTIONS 256
-
 #define OF_IMM 0x0100
 #define OF_PTR 0x0200
 #define OF_LSL 0x0400
@@ -50,6 +43,31 @@ typedef unsigned short WORD;
 #define CPSR_T (1U << 5)   // Thumb State
 #define MSB (1U << 31)  // Most Significant Bit
 
+// Status returned by execute() / avm_call()
+#define AVM_OK          0
+#define AVM_YIELD       1
+#define AVM_INTERRUPTED 2
+#define AVM_FAULT       3
+
+// vm->location while the loop unwinds after vm_halt(); always >= progsize
+#define VM_HALTED 0xfffffff0
+
+// Return address of a fiber's entry function, relative to progsize (fiber.c)
+#define VM_FIBER_RETURN 4
+
+// avm_loadbuffer rounds the program region up to this size (see avm_reload)
+#define AVM_PROGRAM_ALIGN 4096
+
+// OP_BEXT index bit selecting an import slot instead of a call id
+#define VM_IMPORT 0x8000
+
+// Guest addresses from here up are windows onto host memory (vm_mapregion)
+#define VM_REGION_BASE 0x80000000u
+
+// Access to a mapped region (avm_mapbuffer); writable regions are readable
+#define AVM_MAP_READ  1
+#define AVM_MAP_WRITE 2
+
 typedef enum {
     OPSHFT_LSL = 0b00, // logical left
     OPSHFT_LSR = 0b01, // logical right
@@ -73,6 +91,7 @@ typedef enum {
     OPCOND_GT = 0b1100, // Z clear AND (N equals V), greater than
     OPCOND_LE = 0b1101, // Z set OR (N not equal to V), less than or equal
     OPCOND_AL = 0b1110, // (ignored), always
+    OPCOND_NV = 0b1111, // unconditional instruction space (clrex, dmb)
 } OPCOND;
 
 // Data Processing
@@ -128,6 +147,13 @@ enum {
 #define OP_LDRSBI (0b1001 << 4 | 0b1 << 22)
 #define MASK_LDRSBI (0b111 << 25 | 0b1 << 22 | 0b1001 << 4)
 
+#define OP_LDREX   0x01900f9f  // ldrex Rt, [Rn]
+#define OP_STREX   0x01800f90  // strex Rd, Rt, [Rn]
+#define MASK_EX    0x0fe00ff0
+#define OP_CLREX   0xf57ff01f
+#define OP_DMB     0xf57ff050  // low four bits select the barrier domain
+#define MASK_DMB   0xfffffff0
+
 #define OP_BEXT (0xff << 20)
 #define MASK_BEXT (0xff << 20)
 
@@ -145,8 +171,6 @@ typedef struct _LOCATION {
 
 typedef DWORD (*SETPOSPROC)(LPLOCATION, DWORD);
 
-// Head of the linked list
-struct Node;
 
 struct VM;
 
@@ -160,25 +184,135 @@ typedef DWORD (*VM_SysCall)(struct VM *, DWORD);
  * Return 0 for no value (void) or 1 when a result has been written to r0
  * via avm_pushinteger/avm_pushnumber/avm_pushboolean.
  * Multiple return registers are not part of the public API contract.
+ * Return avm_yield(S) to suspend the guest until avm_resume().
  */
 typedef int (*avm_CFunction)(struct VM *);
 
+/*
+ * Callbacks of an I/O region (avm_mapio).  offset is relative to the start
+ * of the region and size is the access width in bytes (1, 2 or 4).
+ */
+typedef DWORD (*avm_IORead)(struct VM *, void *ud, DWORD offset, int size);
+typedef void  (*avm_IOWrite)(struct VM *, void *ud, DWORD offset, DWORD value, int size);
+
+/*
+ * Host-function registry (registry.c), shared by reference between states.
+ * fn[id] and names[id] are valid for call ids 1..count.
+ */
+typedef struct avm_Registry {
+    int refs;
+    DWORD count;
+    DWORD capacity;
+    avm_CFunction *fn;
+    char **names;
+    DWORD *index;       /* hash of call ids by fnv1a32(name), 0 = empty */
+    DWORD mask;
+} avm_Registry;
+
+/*
+ * Execution counters kept while a state runs (avm_setstats).  The host owns
+ * the struct and its arrays: calls[] is indexed by call id and has numcalls
+ * entries, profile[] counts executions per program word and has progsize / 4
+ * entries.  Either array may be NULL.
+ */
+typedef struct avm_Stats {
+    unsigned long long instructions;
+    unsigned long long hostcalls;
+    /* The run stops with AVM_INTERRUPTED when instructions reaches budget;
+       0 means no limit */
+    unsigned long long budget;
+    unsigned long long *calls;
+    DWORD numcalls;
+    unsigned long long *profile;
+} avm_Stats;
+
+/*
+ * Guest memory usage reported by avm_memstats.  Heap sizes are in bytes and
+ * count block headers; the counters cover the life of the heap.
+ */
+typedef struct avm_MemStats {
+    DWORD heapsize;     /* bytes the heap arena spans now */
+    DWORD inuse;        /* bytes in allocated blocks */
+    DWORD free;         /* bytes in free blocks */
+    DWORD largestfree;  /* largest free block */
+    DWORD freeblocks;   /* number of free blocks */
+    unsigned long long allocs;
+    unsigned long long frees;
+    DWORD stacksize;
+    DWORD stacklow;     /* lowest SP written back by push/stmdb */
+    DWORD stackused;    /* deepest stack use seen, from the top of the stack */
+} avm_MemStats;
+
+/*
+ * The fields every instruction touches come first, so they share the first
+ * two cache lines (r[] alone fills one); everything after them is only used
+ * by host calls and the API.
+ */
 typedef struct VM {
-    DWORD r[NUM_REGISTERS];
     BYTE *memory;
-    VM_SysCall syscall;
     DWORD location;
+    DWORD cpsr;
+    DWORD r[NUM_REGISTERS];
+    DWORD progsize;
+    /* Set by avm_interrupt() from any thread; polled at safepoints only */
+    int interrupt;
+    /* Lowest SP written back by push/stmdb (avm_memstats) */
+    DWORD splow;
+    VM_SysCall syscall;
+    /* Functions for avm_register/import slots; threads share their parent's */
+    avm_Registry *registry;
     DWORD stacksize;
     DWORD heapsize;
-    DWORD progsize;
-    DWORD cpsr;
-    struct Node *head;
-    /* Lua-like function registry — populated via avm_register() */
-    avm_CFunction cfuncs[AVM_MAX_CFUNCTIONS];
-    DWORD num_cfuncs;
+    DWORD head;         /* offset of the heap allocator's control block */
     /* Entry point set by avm_loadbuffer() (position of _main label) */
     DWORD entry_point;
-} *LPVM;
+    /* Non-NULL when memory lives inside a file mapping (avm_undump) or
+       reserved address space (avm_setlimits) */
+    void *mapping;
+    size_t mapsize;
+    /* Initial heap arena when the heap grows on demand up to heapsize
+       (avm_setlimits), 0 for a fixed heap */
+    DWORD heapinit;
+    /* Host-call journal (avm_journal); journaled is the wrapped dispatcher */
+    FILE *journal;
+    VM_SysCall journaled;
+    BYTE *shadow;
+    DWORD shadowsize;
+    /* Why the last run stopped, and where it stopped (see vm_halt) */
+    int status;
+    DWORD resume;
+    /* Number of avm_callnested frames currently running */
+    DWORD depth;
+    /* Number of vm_run loops on the host stack, nested calls included */
+    DWORD running;
+    /* Execution counters (avm_setstats), NULL when not counting */
+    avm_Stats *stats;
+    /* Hash index of exported (.globl) symbols, see vm_addexport() */
+    struct _EXPORT *exports;
+    DWORD numexports;
+    DWORD exportmask;
+    /* Import slots for "bl _name" calls, bound on first call (vm_bindimport) */
+    struct _IMPORT *imports;
+    DWORD numimports;
+    /* Exclusive monitor: address and value seen by the last ldrex */
+    DWORD exaddr;
+    DWORD exvalue;
+    BOOL exclusive;
+    /* Guest threads (thread.c): shared by a state and all its threads */
+    struct _THREADS *threads;
+    struct VM *parent;  /* owning state for a thread, NULL otherwise */
+    DWORD stackblock;   /* guest address of a thread's heap-allocated stack */
+    DWORD stacktop;     /* initial SP of a thread */
+    /* Fibers (fiber.c): running fiber, 0 for the main context, and the
+       record the main context is saved into */
+    DWORD fiber;
+    DWORD fibermain;
+    /* Host memory mapped at VM_REGION_BASE and up, sorted by base; threads
+       use their parent's table */
+    struct _REGION *regions;
+    DWORD numregions;
+    DWORD regiontop;    /* guest address the next region is mapped at */
+} __attribute__((aligned(64))) *LPVM;
 
 /* avm_State is the public alias for struct VM (mirrors lua_State). */
 typedef struct VM avm_State;
@@ -193,20 +327,106 @@ struct _VMHDR {
 
 typedef char SYMBOL[64];
 
-void execute(LPVM vm, DWORD pc);
+int execute(LPVM vm, DWORD pc);
+
+// Run from vm->location until the program returns or halts
+int vm_run(LPVM vm);
+
+// Stop the running loop with an AVM_* status; the first reason wins
+void vm_halt(LPVM vm, int status);
 
 // Function to initialize the memory manager
 void initialize_memory_manager(LPVM vm, void* buffer, size_t buffer_size);
 
-// Function to allocate memory from the buffer
+// Start the heap with an arena of initial bytes that grows on demand up to
+// buffer_size
+void vm_initheap(LPVM vm, void *buffer, DWORD buffer_size, DWORD initial);
+
+// Function to allocate memory from the buffer; blocks are 16-byte aligned
 void* my_malloc(LPVM vm, size_t size);
 
 // Function to free previously allocated memory
 void my_free(LPVM vm, void* ptr);
 
+// Resize a block, in place when the following block is free; like realloc,
+// returns NULL and keeps ptr when there is no room
+void* my_realloc(LPVM vm, void* ptr, size_t size);
+
+// Allocate count * size zeroed bytes; memory the heap has never handed out
+// is known to be zero and is not cleared again
+void* my_calloc(LPVM vm, size_t count, size_t size);
+
+// Allocate a zeroed, cache-line aligned struct VM
+LPVM vm_alloc(void);
+
 LPVM vm_create(VM_SysCall, DWORD stack_size, DWORD heap_size, BYTE *program, DWORD progsize);
 void vm_shutdown(LPVM);
 
+// Release vm->memory, whether it was malloc'ed or mapped from a snapshot
+void vm_freememory(LPVM);
+
+// Guest memory for a program region of progsize bytes plus the stack and
+// heap.  vm_setmemory replaces vm->memory with it, setting up the stack
+// pointer and heap; vm_releasememory drops one that was never installed.
+BYTE *vm_allocmemory(LPVM, DWORD progsize);
+void vm_setmemory(LPVM, BYTE *memory, DWORD progsize);
+void vm_releasememory(LPVM, BYTE *memory, DWORD progsize);
+
+// Exported symbol index used by avm_getfunction()
+struct _EXPORT {
+    DWORD hash;
+    DWORD position;
+    DWORD size;         /* bytes of a .comm data object, 0 for code */
+    char *name;
+};
+
+void vm_addexport(LPVM, LPCSTR name, DWORD position, DWORD size);
+const struct _EXPORT *vm_getexport(LPVM, LPCSTR name);
+BOOL vm_findexport(LPVM, LPCSTR name, DWORD *position);
+void vm_clearexports(LPVM);
+
+DWORD fnv1a32(LPCSTR str);
+
+// Import slot: host function name and its registry call id once bound (0 before)
+struct _IMPORT {
+    DWORD call_id;
+    SYMBOL name;
+};
+
+// Call id registered under name, 0 if none (registry.c)
+DWORD vm_lookupfunction(const avm_Registry *, LPCSTR name);
+
+DWORD vm_addimport(LPVM, LPCSTR name);
+DWORD vm_bindimport(LPVM, struct _IMPORT *imp);
+void vm_clearimports(LPVM);
+
+// Host memory visible to guest code at [base, base + size)
+struct _REGION {
+    DWORD base;
+    DWORD size;
+    BYTE *host;                     /* NULL for an I/O region */
+    DWORD flags;                    /* AVM_MAP_* */
+    avm_IORead read;                /* I/O callbacks, called with owner */
+    avm_IOWrite write;
+    void (*release)(void *owner);   /* called on unmap, may be NULL */
+    void *owner;
+};
+
+DWORD vm_mapregion(LPVM, BYTE *host, DWORD size, DWORD flags,
+                   void (*release)(void *), void *owner);
+BOOL vm_unmapregion(LPVM, DWORD base);
+const struct _REGION *vm_findregion(LPVM, DWORD addr);
+BYTE *vm_regionptr(LPVM, DWORD addr, DWORD access, DWORD *avail);
+void vm_clearregions(LPVM);
+
+// Serialise my_malloc/my_free once a state has guest threads (thread.c)
+void vm_lockheap(LPVM);
+void vm_unlockheap(LPVM);
+void vm_closethreads(LPVM);
+
+// Finish the running fiber and switch back to its resumer (fiber.c)
+void vm_fiberreturn(LPVM);
+
 #define MAX_SYMBOLS 1024 * 64
 
 extern SYMBOL symbols[MAX_SYMBOLS];
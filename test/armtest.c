@@ -3,8 +3,11 @@
  * Converted from XCTest to plain C test runner
  */
 
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "avm.h"
 
 // Test function declarations (from compiler.c)
@@ -194,6 +197,1318 @@ void testFloatRoundtrip() {
     avm_close(S);
 }
 
+static int test_malloc_fn(avm_State *S) {
+    void *ptr = my_malloc(S, avm_touinteger(S, 1));
+    avm_pushinteger(S, ptr ? (int)((BYTE *)ptr - S->memory) : 0);
+    return 1;
+}
+
+void testDumpUndump() {
+    // A snapshot must carry the heap free list: after restoring, the second
+    // allocation has to land after the block allocated before the dump.
+    // Exported functions stay callable by name on the restored state.
+    const char *code =
+    "_main:\n"
+    "mov r0, #16\n"
+    "bl _malloc\n"
+    "mov r1, #77\n"
+    "str r1, [r0]\n"
+    "bx lr\n"
+    ".globl _triple\n"
+    "_triple:\n"
+    "add r0, r0, r0, lsl #1\n"
+    "bx lr\n";
+    char path[] = "/tmp/armtestXXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_register(S, "malloc", test_malloc_fn);
+    avm_loadbuffer(S, code, strlen(code));
+    avm_call(S, S->entry_point);
+    DWORD first = avm_touinteger(S, 1);
+    int dumped = avm_dump(S, path);
+    avm_close(S);
+    ASSERT_EQUAL(dumped, 0, "testDumpUndump (dump)");
+
+    avm_State *L = avm_undump(path);
+    ASSERT_EQUAL(L != NULL, 1, "testDumpUndump (undump)");
+    if (L) {
+        ASSERT_EQUAL(avm_touinteger(L, 1), first, "testDumpUndump (registers)");
+        ASSERT_EQUAL(*(DWORD *)(L->memory + first), 77, "testDumpUndump (memory)");
+        avm_register(L, "malloc", test_malloc_fn);
+        avm_call(L, L->entry_point);
+        ASSERT_EQUAL(avm_touinteger(L, 1) > first, 1, "testDumpUndump (heap)");
+        DWORD triple = avm_getfunction(L, "triple");
+        ASSERT_EQUAL(triple != AVM_NOFUNCTION, 1, "testDumpUndump (export)");
+        ASSERT_EQUAL(avm_pcall(L, triple, 1, 14), AVM_OK, "testDumpUndump (named call)");
+        ASSERT_EQUAL(avm_touinteger(L, 1), 42, "testDumpUndump (named result)");
+        avm_close(L);
+    }
+    unlink(path);
+}
+
+static int fill_calls = 0;
+
+static int test_fill_fn(avm_State *S) {
+    fill_calls++;
+    *(DWORD *)avm_topointer(S, 1) = 100;
+    avm_pushinteger(S, 5);
+    return 1;
+}
+
+void testJournalReplay() {
+    // Replaying must reproduce the host's result and memory writes without
+    // calling the host function again.
+    const char *code =
+    "_main:\n"
+    "sub r4, sp, #64\n"
+    "mov r0, r4\n"
+    "bl _fill\n"
+    "ldr r1, [r4]\n"
+    "add r0, r0, r1\n"
+    "bx lr\n";
+    char path[] = "/tmp/armtestXXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_register(S, "fill", test_fill_fn);
+    avm_loadbuffer(S, code, strlen(code));
+    ASSERT_EQUAL(avm_journal(S, AVM_JOURNAL_RECORD, path), 0, "testJournalReplay (record)");
+    avm_call(S, S->entry_point);
+    ASSERT_EQUAL(avm_touinteger(S, 1), 105, "testJournalReplay (recorded run)");
+    avm_close(S);
+
+    fill_calls = 0;
+    S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_register(S, "fill", test_fill_fn);
+    avm_loadbuffer(S, code, strlen(code));
+    ASSERT_EQUAL(avm_journal(S, AVM_JOURNAL_REPLAY, path), 0, "testJournalReplay (replay)");
+    avm_call(S, S->entry_point);
+    ASSERT_EQUAL(avm_touinteger(S, 1), 105, "testJournalReplay (replayed run)");
+    ASSERT_EQUAL(fill_calls, 0, "testJournalReplay (host not called)");
+    avm_close(S);
+    unlink(path);
+}
+
+static int test_interrupt_fn(avm_State *S) {
+    avm_interrupt(S);
+    return 0;
+}
+
+void testInterrupt() {
+    // A pending interrupt must stop a runaway loop at its backward branch.
+    const char *spin =
+    "_main:\n"
+    "mov r0, #0\n"
+    "_spin:\n"
+    "add r0, r0, #1\n"
+    "b _spin\n";
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_loadbuffer(S, spin, strlen(spin));
+    avm_interrupt(S);
+    ASSERT_EQUAL(avm_call(S, S->entry_point), AVM_INTERRUPTED, "testInterrupt (loop)");
+    ASSERT_EQUAL(avm_touinteger(S, 1), 1, "testInterrupt (one iteration)");
+    avm_close(S);
+
+    // An interrupt raised during a host call stops right after it returns.
+    const char *host =
+    "_main:\n"
+    "mov r0, #7\n"
+    "bl _stop\n"
+    "mov r0, #9\n"
+    "bx lr\n";
+    S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_register(S, "stop", test_interrupt_fn);
+    avm_loadbuffer(S, host, strlen(host));
+    ASSERT_EQUAL(avm_call(S, S->entry_point), AVM_INTERRUPTED, "testInterrupt (host call)");
+    ASSERT_EQUAL(avm_touinteger(S, 1), 7, "testInterrupt (stopped at boundary)");
+    ASSERT_EQUAL(S->interrupt, 0, "testInterrupt (consumed)");
+    avm_close(S);
+}
+
+static int test_yield_fn(avm_State *S) {
+    return avm_yield(S);
+}
+
+void testYieldResume() {
+    // A yielding host call parks the guest; avm_resume supplies r0.
+    const char *code =
+    "_main:\n"
+    "mov r4, #1\n"
+    "bl _wait\n"
+    "add r0, r0, r4\n"
+    "bl _wait\n"
+    "add r0, r0, r4\n"
+    "bx lr\n";
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_register(S, "wait", test_yield_fn);
+    avm_loadbuffer(S, code, strlen(code));
+    ASSERT_EQUAL(avm_call(S, S->entry_point), AVM_YIELD, "testYieldResume (yield)");
+    ASSERT_EQUAL(avm_resume(S, 41), AVM_YIELD, "testYieldResume (second yield)");
+    ASSERT_EQUAL(avm_touinteger(S, 1), 42, "testYieldResume (first result)");
+    ASSERT_EQUAL(avm_resume(S, 100), AVM_OK, "testYieldResume (finish)");
+    ASSERT_EQUAL(avm_touinteger(S, 1), 101, "testYieldResume (second result)");
+    avm_close(S);
+}
+
+static DWORD test_ring;
+
+static int test_add_fn(avm_State *S) {
+    avm_pushinteger(S, avm_tointeger(S, 1) + avm_tointeger(S, 2));
+    return 1;
+}
+
+static int test_getring_fn(avm_State *S) {
+    avm_pushinteger(S, (int)test_ring);
+    return 1;
+}
+
+void testRingSubmit() {
+    // Three queued requests are completed by a single ring_submit call.
+    const char *code =
+    "_main:\n"
+    "bl _getring\n"
+    "bl _ring_submit\n"
+    "bx lr\n";
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_register(S, "add", test_add_fn);
+    avm_register(S, "getring", test_getring_fn);
+    avm_register(S, "ring_submit", avm_ringsubmit);
+    avm_loadbuffer(S, code, strlen(code));
+
+    test_ring = avm_newring(S, 4);
+    avm_Ring *ring = (avm_Ring *)(S->memory + test_ring);
+    avm_RingSQE *sqes = (avm_RingSQE *)(S->memory + ring->sqes);
+    avm_RingCQE *cqes = (avm_RingCQE *)(S->memory + ring->cqes);
+    for (DWORD i = 0; i < 3; i++) {
+        sqes[i].func = avm_callid(S, "add");
+        sqes[i].args[0] = i;
+        sqes[i].args[1] = 10;
+        sqes[i].user_data = 100 + i;
+    }
+    ring->sq_tail = 3;
+
+    avm_call(S, S->entry_point);
+    ASSERT_EQUAL(avm_touinteger(S, 1), 3, "testRingSubmit (batch)");
+    ASSERT_EQUAL(ring->cq_tail, 3, "testRingSubmit (completions)");
+    ASSERT_EQUAL(cqes[2].user_data, 102, "testRingSubmit (user data)");
+    ASSERT_EQUAL(cqes[2].result, 12, "testRingSubmit (result)");
+
+    // The guest owns the header, so a bad ring faults instead of letting
+    // the host write completions outside guest memory.
+    ring->cqes = 0x7ffffff0;
+    ring->sq_tail = 4;
+    ASSERT_EQUAL(avm_call(S, S->entry_point), AVM_FAULT, "testRingSubmit (far cqes)");
+    ASSERT_EQUAL(ring->cq_tail, 3, "testRingSubmit (far cqes untouched)");
+    ring->cqes = ring->sqes + 4 * sizeof(avm_RingSQE);
+    ring->entries = 0;
+    ASSERT_EQUAL(avm_drainring(S, test_ring), -1, "testRingSubmit (zero entries)");
+    ring->entries = 4;
+    test_ring = 0xfffffff0;
+    ASSERT_EQUAL(avm_call(S, S->entry_point), AVM_FAULT, "testRingSubmit (bad address)");
+    avm_close(S);
+}
+
+static int add_calls = 0;
+
+static int test_countadd_fn(avm_State *S) {
+    add_calls++;
+    avm_pushinteger(S, avm_tointeger(S, 1) + avm_tointeger(S, 2));
+    return 1;
+}
+
+static DWORD _journalring(avm_State *S) {
+    // Three "add" requests, completed by one ring_submit from the guest
+    DWORD ring = avm_newring(S, 4);
+    avm_Ring *r = (avm_Ring *)(S->memory + ring);
+    avm_RingSQE *sqes = (avm_RingSQE *)(S->memory + r->sqes);
+    for (DWORD i = 0; i < 3; i++) {
+        sqes[i].func = avm_callid(S, "add");
+        sqes[i].args[0] = i;
+        sqes[i].args[1] = 10;
+    }
+    r->sq_tail = 3;
+    return ring;
+}
+
+void testJournalRing() {
+    // The host calls ring_submit makes are part of the guest's call: the
+    // journal holds one entry for it, and replay restores the completions
+    // without running any of them.
+    const char *code =
+    "_main:\n"
+    "push {r4, r5, lr}\n"
+    "bl _getring\n"
+    "mov r4, r0\n"
+    "bl _ring_submit\n"
+    "mov r5, r0\n"
+    "ldr r1, [r4, #8]\n"
+    "ldr r0, [r1, #20]\n"
+    "add r0, r0, r5\n"
+    "pop {r4, r5, pc}\n";
+    char path[] = "/tmp/armtestXXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_register(S, "add", test_countadd_fn);
+    avm_register(S, "getring", test_getring_fn);
+    avm_register(S, "ring_submit", avm_ringsubmit);
+    avm_loadbuffer(S, code, strlen(code));
+    test_ring = _journalring(S);
+    ASSERT_EQUAL(avm_journal(S, AVM_JOURNAL_RECORD, path), 0, "testJournalRing (record)");
+    avm_call(S, S->entry_point);
+    ASSERT_EQUAL(avm_touinteger(S, 1), 12 + 3, "testJournalRing (recorded run)");
+    ASSERT_EQUAL(add_calls, 3, "testJournalRing (recorded adds)");
+    avm_journal(S, AVM_JOURNAL_OFF, NULL);
+    avm_close(S);
+
+    add_calls = 0;
+    S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_register(S, "add", test_countadd_fn);
+    avm_register(S, "getring", test_getring_fn);
+    avm_register(S, "ring_submit", avm_ringsubmit);
+    avm_loadbuffer(S, code, strlen(code));
+    test_ring = _journalring(S);
+    ASSERT_EQUAL(avm_journal(S, AVM_JOURNAL_REPLAY, path), 0, "testJournalRing (replay)");
+    avm_call(S, S->entry_point);
+    ASSERT_EQUAL(avm_touinteger(S, 1), 12 + 3, "testJournalRing (replayed run)");
+    ASSERT_EQUAL(add_calls, 0, "testJournalRing (host not called)");
+    avm_Ring *ring = (avm_Ring *)(S->memory + test_ring);
+    ASSERT_EQUAL(ring->cq_tail, 3, "testJournalRing (completions restored)");
+    // Exactly the guest's three calls were journaled
+    DWORD extra;
+    ASSERT_EQUAL(fread(&extra, sizeof(extra), 1, S->journal), 0, "testJournalRing (journal consumed)");
+    avm_close(S);
+    unlink(path);
+}
+
+static int test_apply_fn(avm_State *S) {
+    DWORD arg = avm_touinteger(S, 2);
+    avm_callnested(S, avm_touinteger(S, 1), 1, &arg);
+    avm_pushinteger(S, avm_tointeger(S, 1) + 1);
+    return 1;
+}
+
+void testCallNested() {
+    // A host function calls back into guest code; the caller's callee-saved
+    // registers must survive the nested call.
+    const char *code =
+    "_main:\n"
+    "mov r4, #5\n"
+    "adr r0, _double\n"
+    "mov r1, #20\n"
+    "bl _apply\n"
+    "add r0, r0, r4\n"
+    "bx lr\n"
+    "_double:\n"
+    "mov r4, #0\n"
+    "add r0, r0, r0\n"
+    "bx lr\n";
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_register(S, "apply", test_apply_fn);
+    avm_loadbuffer(S, code, strlen(code));
+    ASSERT_EQUAL(avm_call(S, S->entry_point), AVM_OK, "testCallNested (status)");
+    ASSERT_EQUAL(avm_touinteger(S, 1), 46, "testCallNested (result)");
+    avm_close(S);
+}
+
+void testPcall() {
+    // Named exports are callable directly; arguments 5 and 6 go on the stack.
+    const char *code =
+    ".globl _sum6\n"
+    ".globl _twice\n"
+    "_sum6:\n"
+    "add r0, r0, r1\n"
+    "add r0, r0, r2\n"
+    "add r0, r0, r3\n"
+    "ldr r12, [sp]\n"
+    "add r0, r0, r12\n"
+    "ldr r12, [sp, #4]\n"
+    "add r0, r0, r12\n"
+    "bx lr\n"
+    "_twice:\n"
+    "add r0, r0, r0\n"
+    "bx lr\n";
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_loadbuffer(S, code, strlen(code));
+    DWORD sum6 = avm_getfunction(S, "sum6");
+    DWORD twice = avm_getfunction(S, "_twice");
+    ASSERT_EQUAL(avm_getfunction(S, "missing"), AVM_NOFUNCTION, "testPcall (missing)");
+    ASSERT_EQUAL(avm_pcall(S, sum6, 6, 1, 2, 3, 4, 5, 6), AVM_OK, "testPcall (status)");
+    ASSERT_EQUAL(avm_touinteger(S, 1), 21, "testPcall (stack arguments)");
+    avm_pcall(S, twice, 1, 21);
+    ASSERT_EQUAL(avm_touinteger(S, 1), 42, "testPcall (second export)");
+    avm_close(S);
+
+    // A top-level pcall stopped by its budget has no guest caller to pass
+    // the interrupt on to, so the next call runs to completion.
+    const char *spin =
+    ".globl _spin\n"
+    ".globl _twice\n"
+    "_spin:\n"
+    "b _spin\n"
+    "_twice:\n"
+    "add r0, r0, r0\n"
+    "bx lr\n";
+    S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_loadbuffer(S, spin, strlen(spin));
+    avm_Stats stats = { 0 };
+    stats.budget = 100;
+    avm_setstats(S, &stats);
+    ASSERT_EQUAL(avm_pcall(S, avm_getfunction(S, "spin"), 0), AVM_INTERRUPTED, "testPcall (budget)");
+    avm_setstats(S, NULL);
+    ASSERT_EQUAL(S->interrupt, 0, "testPcall (interrupt consumed)");
+    ASSERT_EQUAL(avm_pcall(S, avm_getfunction(S, "twice"), 1, 4), AVM_OK, "testPcall (after interrupt)");
+    ASSERT_EQUAL(avm_touinteger(S, 1), 8, "testPcall (after interrupt result)");
+    avm_close(S);
+}
+
+void testCallBatch() {
+    // One guest function applied to four (x, y) tuples; the fifth word is
+    // passed on the stack to check per-element stack arguments too.
+    const char *code =
+    ".globl _score\n"
+    "_score:\n"
+    "mul r0, r0, r1\n"
+    "add r0, r0, r2\n"
+    "add r0, r0, r3\n"
+    "ldr r12, [sp]\n"
+    "add r0, r0, r12\n"
+    "bx lr\n";
+    DWORD args[4][5] = {
+        { 2, 3, 0, 0, 1 },
+        { 4, 5, 1, 0, 0 },
+        { 6, 7, 0, 2, 0 },
+        { 8, 9, 1, 1, 1 },
+    };
+    DWORD results[4] = { 0 };
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_loadbuffer(S, code, strlen(code));
+    DWORD sp = S->r[SP_REG];
+    DWORD score = avm_getfunction(S, "score");
+    ASSERT_EQUAL(avm_callbatch(S, score, &args[0][0], 5, 4, results), AVM_OK, "testCallBatch (status)");
+    ASSERT_EQUAL(results[0] + results[1] + results[2] + results[3], 7 + 21 + 44 + 75, "testCallBatch (results)");
+    ASSERT_EQUAL(S->r[SP_REG], sp, "testCallBatch (sp restored)");
+
+    // A host-level batch stopped by its budget leaves no interrupt pending
+    avm_Stats stats = { 0 };
+    stats.budget = 10;
+    avm_setstats(S, &stats);
+    ASSERT_EQUAL(avm_callbatch(S, score, &args[0][0], 5, 4, results), AVM_INTERRUPTED, "testCallBatch (budget)");
+    avm_setstats(S, NULL);
+    ASSERT_EQUAL(S->interrupt, 0, "testCallBatch (interrupt consumed)");
+    ASSERT_EQUAL(avm_callbatch(S, score, &args[0][0], 5, 4, results), AVM_OK, "testCallBatch (after interrupt)");
+    ASSERT_EQUAL(results[3], 75, "testCallBatch (after interrupt result)");
+    avm_close(S);
+}
+
+static int typed_calls;
+
+static int typed_sum(const int *items, int n) {
+    int sum = 0;
+    typed_calls++;
+    if (!items) return -1;
+    for (int i = 0; i < n; i++) sum += items[i];
+    return sum;
+}
+AVM_THUNK2(i, typed_sum, p, i)
+
+static int typed_sum5(int a, int b, int c, int d, int e) {
+    typed_calls++;
+    return a + b + c + d + e;
+}
+AVM_THUNK5(i, typed_sum5, i, i, i, i, i)
+
+void testTypedThunk() {
+    // A plain C function registered through a generated thunk, including a
+    // bad pointer that must stop the run before the function is called.
+    const char *code =
+    ".globl _run\n"
+    "_run:\n"
+    "mov r4, lr\n"
+    "bl _typed_sum\n"
+    "mov lr, r4\n"
+    "bx lr\n"
+    ".globl _run5\n"
+    "_run5:\n"
+    "push {r4, lr}\n"
+    "sub sp, sp, #8\n"
+    "str r0, [sp]\n"
+    "mov r0, #1\n"
+    "mov r1, #2\n"
+    "mov r2, #3\n"
+    "mov r3, #4\n"
+    "bl _typed_sum5\n"
+    "add sp, sp, #8\n"
+    "pop {r4, lr}\n"
+    "bx lr\n"
+    ".globl _badstack\n"
+    "_badstack:\n"
+    "mvn sp, #15\n"
+    "bl _typed_sum5\n"
+    "bx lr\n";
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_register(S, "typed_sum", typed_sum_thunk);
+    avm_register(S, "typed_sum5", typed_sum5_thunk);
+    avm_loadbuffer(S, code, strlen(code));
+    int *items = my_malloc(S, 3 * sizeof(int));
+    items[0] = 10; items[1] = 20; items[2] = 12;
+    DWORD run = avm_getfunction(S, "run");
+    DWORD addr = (DWORD)((BYTE *)items - S->memory);
+    ASSERT_EQUAL(avm_pcall(S, run, 2, addr, 3), AVM_OK, "testTypedThunk (status)");
+    ASSERT_EQUAL(avm_tointeger(S, 1), 42, "testTypedThunk (result)");
+    ASSERT_EQUAL(avm_pcall(S, run, 2, 0xfffffff0, 3), AVM_FAULT, "testTypedThunk (fault)");
+    ASSERT_EQUAL(typed_calls, 1, "testTypedThunk (not called on fault)");
+    ASSERT_EQUAL(avm_pcall(S, run, 2, 0, 3), AVM_OK, "testTypedThunk (null status)");
+    ASSERT_EQUAL(avm_tointeger(S, 1), -1, "testTypedThunk (null pointer)");
+    ASSERT_EQUAL(avm_pcall(S, avm_getfunction(S, "run5"), 1, 5), AVM_OK,
+                 "testTypedThunk (stack argument status)");
+    ASSERT_EQUAL(avm_tointeger(S, 1), 15, "testTypedThunk (stack argument)");
+    typed_calls = 0;
+    ASSERT_EQUAL(avm_pcall(S, avm_getfunction(S, "badstack"), 0), AVM_FAULT,
+                 "testTypedThunk (stack argument fault)");
+    ASSERT_EQUAL(typed_calls, 0, "testTypedThunk (not called on stack fault)");
+    avm_close(S);
+}
+
+static int test_sub_fn(avm_State *S) {
+    avm_pushinteger(S, avm_tointeger(S, 1) - avm_tointeger(S, 2));
+    return 1;
+}
+
+void testLateBinding() {
+    // The program is loaded before any host function exists; calls bind
+    // through import slots on first use and follow later re-registration.
+    const char *code =
+    "_main:\n"
+    "mov r4, lr\n"
+    "mov r0, #7\n"
+    "mov r1, #5\n"
+    "bl _combine\n"
+    "mov lr, r4\n"
+    "bx lr\n";
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_loadbuffer(S, code, strlen(code));
+    ASSERT_EQUAL(avm_bind(S), 1, "testLateBinding (unresolved)");
+    ASSERT_EQUAL(avm_call(S, S->entry_point), AVM_FAULT, "testLateBinding (missing import)");
+    avm_register(S, "combine", test_add_fn);
+    ASSERT_EQUAL(avm_call(S, S->entry_point), AVM_OK, "testLateBinding (status)");
+    ASSERT_EQUAL(avm_tointeger(S, 1), 12, "testLateBinding (bound on first call)");
+    avm_register(S, "combine", test_sub_fn);
+    avm_call(S, S->entry_point);
+    ASSERT_EQUAL(avm_tointeger(S, 1), 2, "testLateBinding (swapped)");
+    ASSERT_EQUAL(avm_bind(S), 0, "testLateBinding (all bound)");
+    avm_close(S);
+}
+
+void testReload() {
+    // New code replaces the old in place: .comm data and heap blocks survive,
+    // exports move and are found again by name.
+    const char *v1 =
+    ".globl _bump\n"
+    "_bump:\n"
+    "adr r1, _counter\n"
+    "ldr r0, [r1]\n"
+    "add r0, r0, #1\n"
+    "str r0, [r1]\n"
+    "bx lr\n"
+    ".comm _counter,4,2\n";
+    const char *v2 =
+    ".globl _zero\n"
+    "_zero:\n"
+    "mov r0, #0\n"
+    "bx lr\n"
+    ".globl _bump\n"
+    "_bump:\n"
+    "adr r1, _counter\n"
+    "ldr r0, [r1]\n"
+    "add r0, r0, #10\n"
+    "str r0, [r1]\n"
+    "bx lr\n"
+    ".comm _counter,4,2\n";
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_loadbuffer(S, v1, strlen(v1));
+    DWORD *block = my_malloc(S, sizeof(DWORD));
+    *block = 0xfeed;
+    DWORD bump = avm_getfunction(S, "bump");
+    avm_pcall(S, bump, 0);
+    avm_pcall(S, bump, 0);
+    ASSERT_EQUAL(avm_reload(S, v2, strlen(v2)), 0, "testReload (status)");
+    ASSERT_EQUAL(avm_getfunction(S, "bump") != bump, 1, "testReload (export moved)");
+    avm_pcall(S, avm_getfunction(S, "bump"), 0);
+    ASSERT_EQUAL(avm_touinteger(S, 1), 12, "testReload (data kept)");
+    ASSERT_EQUAL(*block, 0xfeed, "testReload (heap kept)");
+    avm_close(S);
+}
+
+static void register_threads(avm_State *S) {
+    avm_register(S, "thread_spawn", avm_threadspawn);
+    avm_register(S, "thread_join", avm_threadjoin);
+    avm_register(S, "futex_wait", avm_futexwait);
+    avm_register(S, "futex_wake", avm_futexwake);
+}
+
+void testThreads() {
+    // Four guest threads (main plus three spawned) increment one counter
+    // with ldrex/strex; no increment may be lost.
+    const char *code =
+    "_main:\n"
+    "push {r4, r5, r6, r7, lr}\n"
+    "adr r4, _counter\n"
+    "adr r0, _worker\n"
+    "mov r1, r4\n"
+    "bl _thread_spawn\n"
+    "mov r5, r0\n"
+    "adr r0, _worker\n"
+    "mov r1, r4\n"
+    "bl _thread_spawn\n"
+    "mov r6, r0\n"
+    "adr r0, _worker\n"
+    "mov r1, r4\n"
+    "bl _thread_spawn\n"
+    "mov r7, r0\n"
+    "mov r0, r4\n"
+    "bl _worker\n"
+    "mov r0, r5\n"
+    "bl _thread_join\n"
+    "mov r0, r6\n"
+    "bl _thread_join\n"
+    "mov r0, r7\n"
+    "bl _thread_join\n"
+    "ldr r0, [r4]\n"
+    "pop {r4, r5, r6, r7, lr}\n"
+    "bx lr\n"
+    "_worker:\n"
+    "mov r3, #0\n"
+    "L_retry:\n"
+    "ldrex r1, [r0]\n"
+    "add r1, r1, #1\n"
+    "strex r2, r1, [r0]\n"
+    "cmp r2, #0\n"
+    "bne L_retry\n"
+    "add r3, r3, #1\n"
+    "cmp r3, #250\n"
+    "bne L_retry\n"
+    "dmb ish\n"
+    "bx lr\n"
+    ".comm _counter,4,2\n";
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    register_threads(S);
+    avm_loadbuffer(S, code, strlen(code));
+    ASSERT_EQUAL(avm_call(S, S->entry_point), AVM_OK, "testThreads (status)");
+    ASSERT_EQUAL(avm_touinteger(S, 1), 1000, "testThreads (atomic increments)");
+    avm_close(S);
+}
+
+void testFutex() {
+    // A spawned thread sleeps until main publishes a flag and wakes it.
+    const char *code =
+    "_main:\n"
+    "push {r4, r5, lr}\n"
+    "adr r4, _flag\n"
+    "adr r0, _waiter\n"
+    "mov r1, r4\n"
+    "bl _thread_spawn\n"
+    "mov r5, r0\n"
+    "mov r1, #1\n"
+    "dmb\n"
+    "str r1, [r4]\n"
+    "mov r0, r4\n"
+    "bl _futex_wake\n"
+    "mov r0, r5\n"
+    "bl _thread_join\n"
+    "pop {r4, r5, lr}\n"
+    "bx lr\n"
+    "_waiter:\n"
+    "push {r4, lr}\n"
+    "mov r4, r0\n"
+    "L_wait:\n"
+    "ldr r1, [r4]\n"
+    "cmp r1, #0\n"
+    "bne L_done\n"
+    "mov r0, r4\n"
+    "mov r2, #0\n"
+    "bl _futex_wait\n"
+    "b L_wait\n"
+    "L_done:\n"
+    "mov r0, #7\n"
+    "pop {r4, lr}\n"
+    "bx lr\n"
+    ".comm _flag,4,2\n";
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    register_threads(S);
+    avm_loadbuffer(S, code, strlen(code));
+    ASSERT_EQUAL(avm_call(S, S->entry_point), AVM_OK, "testFutex (status)");
+    ASSERT_EQUAL(avm_touinteger(S, 1), 7, "testFutex (woken thread result)");
+    avm_close(S);
+
+    // Futex words outside guest memory, unaligned or in an unmapped region
+    // fault the run instead of being read on the host.
+    const char *probe =
+    ".globl _wake\n"
+    "_wake:\n"
+    "push {lr}\n"
+    "mov r1, #1\n"
+    "bl _futex_wake\n"
+    "pop {lr}\n"
+    "bx lr\n"
+    ".globl _wait\n"
+    "_wait:\n"
+    "push {lr}\n"
+    "mov r1, #0\n"
+    "mov r2, #1\n"
+    "bl _futex_wait\n"
+    "pop {lr}\n"
+    "bx lr\n"
+    ".comm _word,4,2\n";
+    S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    register_threads(S);
+    avm_loadbuffer(S, probe, strlen(probe));
+    DWORD wake = avm_getfunction(S, "_wake"), wait = avm_getfunction(S, "_wait");
+    DWORD end = S->progsize + S->stacksize + S->heapsize;
+    ASSERT_EQUAL(avm_pcall(S, wake, 1, 4), AVM_OK, "testFutex (wake none)");
+    ASSERT_EQUAL(avm_touinteger(S, 1), 0, "testFutex (nobody woken)");
+    ASSERT_EQUAL(avm_pcall(S, wake, 1, end), AVM_FAULT, "testFutex (past memory)");
+    ASSERT_EQUAL(avm_pcall(S, wait, 1, 6), AVM_FAULT, "testFutex (unaligned)");
+    ASSERT_EQUAL(avm_pcall(S, wait, 1, VM_REGION_BASE), AVM_FAULT, "testFutex (unmapped)");
+    avm_close(S);
+}
+
+void testFibers() {
+    // A generator fiber yields 1, 2, 3 and returns 100; its counter lives
+    // in r4 across the switches.  The host drives it first, then a guest
+    // loop drives a second one until it is dead.
+    const char *code =
+    ".globl _gen\n"
+    "_gen:\n"
+    "push {r4, lr}\n"
+    "mov r4, r0\n"
+    "L_gen:\n"
+    "add r4, r4, #1\n"
+    "mov r0, r4\n"
+    "bl _fiber_yield\n"
+    "cmp r4, #3\n"
+    "bne L_gen\n"
+    "mov r0, #100\n"
+    "pop {r4, lr}\n"
+    "bx lr\n"
+    ".globl _drive\n"
+    "_drive:\n"
+    "push {r4, r5, lr}\n"
+    "mov r4, r0\n"
+    "mov r5, #0\n"
+    "L_drive:\n"
+    "mov r0, r4\n"
+    "mov r1, #0\n"
+    "bl _fiber_resume\n"
+    "add r5, r5, r0\n"
+    "ldr r1, [r4, #76]\n"
+    "cmp r1, #3\n"
+    "bne L_drive\n"
+    "mov r0, r5\n"
+    "pop {r4, r5, lr}\n"
+    "bx lr\n"
+    ".globl _forge\n"
+    "_forge:\n"
+    "mvn r1, #15\n"
+    "str r1, [r0, #72]\n"
+    "bl _fiber_yield\n"
+    "bx lr\n";
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_register(S, "fiber_resume", avm_fiberresume);
+    avm_register(S, "fiber_yield", avm_fiberyield);
+    avm_loadbuffer(S, code, strlen(code));
+    DWORD gen = avm_getfunction(S, "_gen");
+
+    DWORD f = avm_newfiber(S, gen, 0, 256);
+    DWORD got[4];
+    for (int i = 0; i < 4; i++) {
+        avm_runfiber(S, f, 0);
+        got[i] = avm_touinteger(S, 1);
+    }
+    avm_Fiber *fiber = (avm_Fiber *)(S->memory + f);
+    ASSERT_EQUAL(got[0] * 1000 + got[1] * 100 + got[2] * 10 + got[3], 1330,
+                 "testFibers (host resume)");
+    ASSERT_EQUAL(fiber->status, AVM_FIBER_DEAD, "testFibers (dead after return)");
+    ASSERT_EQUAL(avm_runfiber(S, f, 0), -1, "testFibers (resume dead fiber)");
+    my_free(S, fiber);
+
+    f = avm_newfiber(S, gen, 0, 256);
+    ASSERT_EQUAL(avm_pcall(S, avm_getfunction(S, "_drive"), 1, f), AVM_OK,
+                 "testFibers (guest resume status)");
+    ASSERT_EQUAL(avm_touinteger(S, 1), 106, "testFibers (guest resume)");
+
+    // Forged fiber addresses and resumers fault instead of reaching past
+    // guest memory.
+    DWORD end = S->progsize + S->stacksize + S->heapsize;
+    ASSERT_EQUAL(avm_runfiber(S, end - 4, 0), -1, "testFibers (host bad fiber)");
+    ASSERT_EQUAL(avm_pcall(S, avm_getfunction(S, "_drive"), 1, 0xfffffff0), AVM_FAULT,
+                 "testFibers (guest bad fiber)");
+    f = avm_newfiber(S, avm_getfunction(S, "_forge"), 0, 256);
+    ASSERT_EQUAL(avm_runfiber(S, f, f), AVM_FAULT, "testFibers (forged resumer)");
+    avm_close(S);
+}
+
+/* Call a channel function the way guest code does, with r0/r1 */
+static int _chancall(avm_State *S, avm_CFunction fn, DWORD ch, DWORD slot) {
+    S->r[0] = ch;
+    S->r[1] = slot;
+    fn(S);
+    return (int)S->r[0];
+}
+
+void testChannels() {
+    // A producer state sends 1..5 through a channel mapped into a consumer
+    // state too; the consumer sums them.  Messages are written and read
+    // in place at the channel's guest address.
+    const char *producer =
+    ".globl _produce\n"
+    "_produce:\n"
+    "push {r4, r5, lr}\n"
+    "mov r4, r0\n"
+    "mov r5, #1\n"
+    "L_send:\n"
+    "mov r0, r4\n"
+    "bl _chan_claim\n"
+    "str r5, [r0]\n"
+    "mov r1, r0\n"
+    "mov r0, r4\n"
+    "bl _chan_send\n"
+    "add r5, r5, #1\n"
+    "cmp r5, #6\n"
+    "bne L_send\n"
+    "pop {r4, r5, lr}\n"
+    "bx lr\n";
+    const char *consumer =
+    ".globl _consume\n"
+    "_consume:\n"
+    "push {r4, r5, lr}\n"
+    "mov r4, r0\n"
+    "mov r5, #0\n"
+    "L_recv:\n"
+    "mov r0, r4\n"
+    "bl _chan_recv\n"
+    "cmp r0, #0\n"
+    "beq L_empty\n"
+    "ldr r1, [r0]\n"
+    "add r5, r5, r1\n"
+    "mov r0, r4\n"
+    "bl _chan_release\n"
+    "b L_recv\n"
+    "L_empty:\n"
+    "mov r0, r5\n"
+    "pop {r4, r5, lr}\n"
+    "bx lr\n";
+    avm_State *P = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_State *C = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_State *states[2] = { P, C };
+    for (int i = 0; i < 2; i++) {
+        avm_register(states[i], "chan_claim", avm_chanclaim);
+        avm_register(states[i], "chan_send", avm_chansend);
+        avm_register(states[i], "chan_recv", avm_chanrecv);
+        avm_register(states[i], "chan_release", avm_chanrelease);
+    }
+    avm_loadbuffer(P, producer, strlen(producer));
+    avm_loadbuffer(C, consumer, strlen(consumer));
+
+    avm_Channel *ch = avm_newchannel(8, 16);
+    DWORD pch = avm_mapchannel(P, ch), cch = avm_mapchannel(C, ch);
+    avm_closechannel(ch);
+    ASSERT_EQUAL(pch >= VM_REGION_BASE && cch >= VM_REGION_BASE, 1, "testChannels (mapped)");
+    ASSERT_EQUAL(avm_pcall(P, avm_getfunction(P, "_produce"), 1, pch), AVM_OK,
+                 "testChannels (produce)");
+    ASSERT_EQUAL(ch->tail, 5, "testChannels (published)");
+    ASSERT_EQUAL(avm_pcall(C, avm_getfunction(C, "_consume"), 1, cch), AVM_OK,
+                 "testChannels (consume)");
+    ASSERT_EQUAL(avm_touinteger(C, 1), 15, "testChannels (sum)");
+    ASSERT_EQUAL(ch->head, 5, "testChannels (drained)");
+
+    // Sends that do not match a claim fail instead of waiting, and a slot
+    // sent before an earlier claim is published along with it
+    DWORD first = pch + sizeof(avm_Channel) + 5 * 16;
+    DWORD second = first + 16;
+    ASSERT_EQUAL(_chancall(P, avm_chansend, pch, first), -1, "testChannels (unclaimed)");
+    ASSERT_EQUAL(_chancall(P, avm_chanclaim, pch, 0), (int)first, "testChannels (claim)");
+    ASSERT_EQUAL(_chancall(P, avm_chanclaim, pch, 0), (int)second, "testChannels (second claim)");
+    ASSERT_EQUAL(_chancall(P, avm_chansend, pch, first + 4), -1, "testChannels (misaligned)");
+    ASSERT_EQUAL(_chancall(P, avm_chansend, pch, pch + sizeof(avm_Channel) + 8 * 16), -1,
+                 "testChannels (past the slots)");
+    ASSERT_EQUAL(_chancall(P, avm_chansend, pch, second), 0, "testChannels (out of order)");
+    ASSERT_EQUAL(ch->tail, 5, "testChannels (held back)");
+    ASSERT_EQUAL(_chancall(P, avm_chansend, pch, second), -1, "testChannels (duplicate)");
+    ASSERT_EQUAL(_chancall(P, avm_chansend, pch, first), 0, "testChannels (first)");
+    ASSERT_EQUAL(ch->tail, 7, "testChannels (published in order)");
+    avm_close(P);
+    avm_close(C);
+}
+
+void testMapBuffer() {
+    // Guest code sums and doubles a host array in place, then faults on a
+    // store to a read-only mapping.
+    const char *code =
+    ".globl _scale\n"
+    "_scale:\n"
+    "mov r2, #0\n"
+    "L_scale:\n"
+    "ldr r3, [r0]\n"
+    "add r2, r2, r3\n"
+    "add r3, r3, r3\n"
+    "str r3, [r0], #4\n"
+    "subs r1, r1, #1\n"
+    "bne L_scale\n"
+    "mov r0, r2\n"
+    "bx lr\n"
+    ".globl _poke\n"
+    "_poke:\n"
+    "str r1, [r0]\n"
+    "bx lr\n";
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_loadbuffer(S, code, strlen(code));
+
+    DWORD data[64];
+    for (int i = 0; i < 64; i++) data[i] = i;
+    DWORD addr = avm_mapbuffer(S, data, sizeof(data), AVM_MAP_WRITE);
+    ASSERT_EQUAL(avm_pcall(S, avm_getfunction(S, "_scale"), 2, addr, 64), AVM_OK,
+                 "testMapBuffer (status)");
+    ASSERT_EQUAL(avm_touinteger(S, 1), 2016, "testMapBuffer (guest read)");
+    ASSERT_EQUAL(data[63], 126, "testMapBuffer (guest write)");
+
+    DWORD ro = avm_mapbuffer(S, data, sizeof(data), AVM_MAP_READ);
+    ASSERT_EQUAL(avm_pcall(S, avm_getfunction(S, "_poke"), 2, ro, 1), AVM_FAULT,
+                 "testMapBuffer (read-only fault)");
+    ASSERT_EQUAL(data[0], 0, "testMapBuffer (read-only unchanged)");
+    ASSERT_EQUAL(avm_unmap(S, addr), 0, "testMapBuffer (unmap)");
+    ASSERT_EQUAL(avm_pcall(S, avm_getfunction(S, "_poke"), 2, addr, 1), AVM_FAULT,
+                 "testMapBuffer (unmapped fault)");
+
+    /* Mapping and unmapping per call reuses the addresses; 4 GiB of
+       1 MiB windows would otherwise run past the region space */
+    static BYTE window[1 << 20];
+    DWORD first = avm_mapbuffer(S, window, sizeof(window), AVM_MAP_READ), last = first;
+    avm_unmap(S, first);
+    for (int i = 0; i < 4096 && last == first; i++) {
+        last = avm_mapbuffer(S, window, sizeof(window), AVM_MAP_READ);
+        avm_unmap(S, last);
+    }
+    ASSERT_EQUAL(last, first, "testMapBuffer (remap reuses addresses)");
+    avm_close(S);
+}
+
+struct test_device {
+    DWORD sum;
+    DWORD count;
+    DWORD lastsize;
+};
+
+static DWORD test_device_read(avm_State *S, void *ud, DWORD offset, int size) {
+    struct test_device *dev = ud;
+    (void)S;
+    (void)size;
+    return offset == 4 ? dev->count : dev->sum;
+}
+
+static void test_device_write(avm_State *S, void *ud, DWORD offset, DWORD value, int size) {
+    struct test_device *dev = ud;
+    (void)S;
+    (void)offset;
+    dev->sum += value;
+    dev->count++;
+    dev->lastsize = (DWORD)size;
+}
+
+void testMapIO() {
+    // Guest streams command words into a device register and reads a
+    // status register back; every access reaches the host callbacks.
+    const char *code =
+    ".globl _stream\n"
+    "_stream:\n"
+    "mov r1, #1\n"
+    "L_cmd:\n"
+    "str r1, [r0]\n"
+    "add r1, r1, #1\n"
+    "cmp r1, #11\n"
+    "bne L_cmd\n"
+    "mov r1, #200\n"
+    "strb r1, [r0, #8]\n"
+    "ldr r0, [r0, #4]\n"
+    "bx lr\n";
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_loadbuffer(S, code, strlen(code));
+    struct test_device dev = { 0 };
+    DWORD io = avm_mapio(S, 16, test_device_read, test_device_write, &dev);
+    ASSERT_EQUAL(avm_pcall(S, avm_getfunction(S, "_stream"), 1, io), AVM_OK,
+                 "testMapIO (status)");
+    ASSERT_EQUAL(dev.sum, 255, "testMapIO (writes)");
+    ASSERT_EQUAL(dev.lastsize, 1, "testMapIO (byte store width)");
+    ASSERT_EQUAL(avm_touinteger(S, 1), 11, "testMapIO (read)");
+    avm_close(S);
+}
+
+static int test_die(avm_State *S) {
+    (void)S;
+    kill(getpid(), SIGKILL);
+    return 0;
+}
+
+static void test_stuck(avm_State *S) {
+    (void)S;
+    for (;;) pause();
+}
+
+void testPool() {
+    // Two forked workers square numbers; a request whose host function
+    // kills its worker faults alone and the pool keeps serving.  So does a
+    // guest that spins past the request timeout, and closing a pool does
+    // not wait for workers that never come back.
+    const char *code =
+    ".globl _square\n"
+    "_square:\n"
+    "mul r0, r0, r0\n"
+    "bx lr\n"
+    ".globl _crash\n"
+    "_crash:\n"
+    "push {lr}\n"
+    "bl _die\n"
+    "pop {lr}\n"
+    "bx lr\n"
+    ".globl _spin\n"
+    "_spin:\n"
+    "b _spin\n";
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_register(S, "die", test_die);
+    avm_loadbuffer(S, code, strlen(code));
+    avm_Pool *P = avm_newpool(S, 2, NULL);
+    ASSERT_EQUAL(P != NULL, 1, "testPool (created)");
+    if (!P) {
+        avm_close(S);
+        return;
+    }
+
+    avm_Request reqs[6];
+    avm_Reply replies[6];
+    memset(reqs, 0, sizeof(reqs));
+    for (DWORD i = 0; i < 6; i++) {
+        reqs[i].id = i;
+        reqs[i].nargs = 1;
+        reqs[i].args[0] = i + 1;
+        strcpy(reqs[i].function, i == 2 ? "crash" : i == 4 ? "missing" : "square");
+    }
+    ASSERT_EQUAL(avm_poolrun(P, reqs, replies, 6), 0, "testPool (run)");
+    ASSERT_EQUAL(replies[5].result, 36, "testPool (result)");
+    ASSERT_EQUAL(replies[0].result + replies[1].result + replies[3].result, 21,
+                 "testPool (results)");
+    ASSERT_EQUAL(replies[2].status, AVM_FAULT, "testPool (crashed worker)");
+    ASSERT_EQUAL(replies[4].status, -1, "testPool (unknown function)");
+    ASSERT_EQUAL(avm_poolrun(P, reqs, replies, 2), 0, "testPool (after crash)");
+    ASSERT_EQUAL(replies[1].status == AVM_OK && replies[1].result == 4, 1,
+                 "testPool (respawned)");
+
+    avm_setpooltimeout(P, 100);
+    strcpy(reqs[0].function, "spin");
+    ASSERT_EQUAL(avm_poolrun(P, reqs, replies, 2), 0, "testPool (timeout run)");
+    ASSERT_EQUAL(replies[0].status, AVM_FAULT, "testPool (timed out)");
+    ASSERT_EQUAL(replies[1].status == AVM_OK && replies[1].result == 4, 1,
+                 "testPool (beside timeout)");
+    avm_closepool(P);
+
+    P = avm_newpool(S, 2, test_stuck);
+    ASSERT_EQUAL(P != NULL, 1, "testPool (stuck workers)");
+    avm_closepool(P);
+    avm_close(S);
+}
+
+static int test_forty_two(avm_State *S) {
+    avm_pushinteger(S, 42);
+    return 1;
+}
+
+void testSharedRegistry() {
+    // Two states share one registry holding more than 256 functions.
+    const char *code =
+    "_main:\n"
+    "push {lr}\n"
+    "bl _fn299\n"
+    "pop {lr}\n"
+    "bx lr\n";
+    avm_Registry *R = avm_newregistry();
+    char name[16];
+    for (int i = 0; i < 299; i++) {
+        snprintf(name, sizeof(name), "fn%d", i);
+        avm_registryset(R, name, NULL);
+    }
+    avm_State *A = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_State *B = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_setregistry(A, R);
+    avm_setregistry(B, R);
+    avm_closeregistry(R);
+    avm_register(A, "fn299", test_forty_two);   /* visible to B as well */
+    avm_loadbuffer(A, code, strlen(code));
+    avm_loadbuffer(B, code, strlen(code));
+    ASSERT_EQUAL(avm_callid(B, "fn299"), 300, "testSharedRegistry (call id)");
+    avm_call(A, A->entry_point);
+    ASSERT_EQUAL(avm_touinteger(A, 1), 42, "testSharedRegistry (first state)");
+    avm_call(B, B->entry_point);
+    ASSERT_EQUAL(avm_touinteger(B, 1), 42, "testSharedRegistry (second state)");
+    avm_close(A);
+    avm_close(B);
+}
+
+void testStats() {
+    // A budget stops a loop part way and avm_resume finishes it; host calls
+    // are counted per call id.
+    const char *code =
+    "_main:\n"
+    "push {lr}\n"
+    "mov r1, #0\n"
+    "loop:\n"
+    "add r1, r1, #1\n"
+    "cmp r1, #100\n"
+    "blt loop\n"
+    "mov r0, #0\n"
+    "bl _free\n"
+    "mov r0, r1\n"
+    "pop {lr}\n"
+    "bx lr\n";
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_openlibs(S);
+    avm_loadbuffer(S, code, strlen(code));
+    unsigned long long calls[16] = {0};
+    avm_Stats stats = { .budget = 50, .calls = calls, .numcalls = 16 };
+    avm_setstats(S, &stats);
+    ASSERT_EQUAL(avm_call(S, S->entry_point), AVM_INTERRUPTED, "testStats (budget)");
+    ASSERT_EQUAL(stats.instructions, 50, "testStats (instructions at budget)");
+    stats.budget = 0;
+    ASSERT_EQUAL(avm_resume(S, 0), AVM_OK, "testStats (resume)");
+    ASSERT_EQUAL(avm_touinteger(S, 1), 100, "testStats (result)");
+    ASSERT_EQUAL(stats.instructions, 2 + 3 * 100 + 5, "testStats (instructions)");
+    ASSERT_EQUAL(calls[avm_callid(S, "free")], 1, "testStats (host calls)");
+    avm_setstats(S, NULL);
+    avm_close(S);
+
+    // An ORCA image: "mov r0, #5; bx lr" with _main exported at 0
+    DWORD image[] = { ID_ORCA, 8, 1, 0xe3a00005, 0xe12fff1e, 0, 0x69616d5f, 0x6e };
+    S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    ASSERT_EQUAL(avm_loadimage(S, image, 6 * sizeof(DWORD) + 6), 0, "testStats (image)");
+    avm_call(S, S->entry_point);
+    ASSERT_EQUAL(avm_touinteger(S, 1), 5, "testStats (image result)");
+    avm_close(S);
+}
+
+void testHeapAllocator() {
+    // Blocks are 16-byte aligned, freed neighbours merge back into one block
+    // and a fragmented heap still serves a large request from its free tail.
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    const char *code = "_main:\nbx lr\n";
+    avm_loadbuffer(S, code, strlen(code));
+    BYTE *blocks[64];
+    int aligned = 1;
+    for (int i = 0; i < 64; i++) {
+        blocks[i] = my_malloc(S, 1 + i * 7);
+        aligned &= blocks[i] && ((blocks[i] - S->memory) & 15) == 0;
+    }
+    ASSERT_EQUAL(aligned, 1, "testHeapAllocator (alignment)");
+    for (int i = 0; i < 64; i += 2) {
+        my_free(S, blocks[i]);
+    }
+    BYTE *large = my_malloc(S, VM_HEAP_SIZE / 2);
+    ASSERT_EQUAL(large != NULL, 1, "testHeapAllocator (fragmented)");
+    my_free(S, large);
+    for (int i = 1; i < 64; i += 2) {
+        my_free(S, blocks[i]);
+    }
+    BYTE *whole = my_malloc(S, VM_HEAP_SIZE - 4096);
+    ASSERT_EQUAL(whole == blocks[0], 1, "testHeapAllocator (coalesced)");
+    avm_close(S);
+}
+
+void testGrowableHeap() {
+    // A 4 KiB heap with a 16 MiB limit grows to serve large requests, gives
+    // the memory back when it is freed and refuses to pass the limit.
+    avm_State *S = avm_newstate(VM_STACK_SIZE, 4096);
+    ASSERT_EQUAL(avm_setlimits(S, 1 << 20, 16 << 20), 0, "testGrowableHeap (limits)");
+    ASSERT_EQUAL(avm_setlimits(S, 0x40000000, 0x40000000), -1, "testGrowableHeap (too large)");
+    const char *code = "_main:\nbx lr\n";
+    avm_loadbuffer(S, code, strlen(code));
+    ASSERT_EQUAL(S->r[SP_REG], S->progsize + (1 << 20), "testGrowableHeap (stack)");
+    BYTE *small = my_malloc(S, 100);
+    BYTE *big = my_malloc(S, 1 << 20);
+    ASSERT_EQUAL(small != NULL && big != NULL, 1, "testGrowableHeap (grown)");
+    memset(big, 0xAB, 1 << 20);
+    BYTE *more[8];
+    int grown = 1;
+    for (int i = 0; i < 8; i++) {
+        more[i] = my_malloc(S, 1 << 20);
+        grown &= more[i] != NULL;
+    }
+    ASSERT_EQUAL(grown, 1, "testGrowableHeap (repeated growth)");
+    ASSERT_EQUAL(my_malloc(S, 16 << 20) == NULL, 1, "testGrowableHeap (over limit)");
+    for (int i = 0; i < 8; i++) {
+        my_free(S, more[i]);
+    }
+    my_free(S, big);
+    my_free(S, small);
+    BYTE *whole = my_malloc(S, 12 << 20);
+    ASSERT_EQUAL(whole == small, 1, "testGrowableHeap (coalesced)");
+    avm_close(S);
+}
+
+void testArena() {
+    // Guest code bumps the arena inline and calls _arena_alloc when it is
+    // full; a reset gives the overflow chunks back to the heap.
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    avm_openlibs(S);
+    const char *code =
+        "_take:\n"
+        "push {lr}\n"
+        "ldr r1, [r0]\n"
+        "ldr r3, [r0, #4]\n"
+        "add r2, r1, #32\n"
+        "cmp r2, r3\n"
+        "strls r2, [r0]\n"
+        "bls have_block\n"
+        "mov r1, #32\n"
+        "bl _arena_alloc\n"
+        "mov r1, r0\n"
+        "have_block:\n"
+        "mov r0, r1\n"
+        "pop {pc}\n"
+        ".globl _take\n"
+        ".globl _alloc\n"
+        "_alloc:\n"
+        "push {lr}\n"
+        "bl _arena_alloc\n"
+        "pop {pc}\n"
+        ".globl _reset\n"
+        "_reset:\n"
+        "push {lr}\n"
+        "bl _arena_reset\n"
+        "pop {pc}\n";
+    ASSERT_EQUAL(avm_loadbuffer(S, code, strlen(code)), 0, "testArena (load)");
+    DWORD take = avm_getfunction(S, "_take");
+    DWORD arena = avm_newarena(S, 100);
+    ASSERT_EQUAL(arena != 0, 1, "testArena (new)");
+    avm_Arena *a = (avm_Arena *)(S->memory + arena);
+    DWORD base = arena + sizeof(avm_Arena);
+
+    DWORD first = avm_arenaalloc(S, arena, 5);
+    ASSERT_EQUAL(first, base, "testArena (first)");
+    ASSERT_EQUAL(avm_arenaalloc(S, arena, 1), base + 8, "testArena (aligned)");
+    avm_pcall(S, take, 1, arena);
+    ASSERT_EQUAL(S->r[0], base + 16, "testArena (guest inline)");
+    avm_pcall(S, take, 1, arena);
+    avm_pcall(S, take, 1, arena);
+    a = (avm_Arena *)(S->memory + arena);
+    ASSERT_EQUAL(a->chunks != 0 && S->r[0] > base + a->size, 1, "testArena (guest overflow)");
+
+    avm_arenareset(S, arena);
+    a = (avm_Arena *)(S->memory + arena);
+    ASSERT_EQUAL(a->top == base && a->chunks == 0, 1, "testArena (reset)");
+    ASSERT_EQUAL(avm_arenaalloc(S, arena, 5), first, "testArena (reuse)");
+
+    // Headers and chunk links come from the guest: bad ones fault the run
+    // instead of being followed on the host.
+    DWORD alloc = avm_getfunction(S, "_alloc"), reset = avm_getfunction(S, "_reset");
+    DWORD end = S->progsize + S->stacksize + S->heapsize;
+    ASSERT_EQUAL(avm_pcall(S, alloc, 2, end - 4, 8), AVM_FAULT, "testArena (bad header)");
+    DWORD chunk = avm_arenaalloc(S, arena, 200) - 16;
+    a = (avm_Arena *)(S->memory + arena);
+    a->chunks = 0x7ffffff0;
+    ASSERT_EQUAL(avm_pcall(S, reset, 1, arena), AVM_FAULT, "testArena (bad chunk link)");
+    a->chunks = chunk;
+    *(DWORD *)(S->memory + chunk) = chunk;
+    ASSERT_EQUAL(avm_pcall(S, reset, 1, arena), AVM_FAULT, "testArena (cyclic chunks)");
+    *(DWORD *)(S->memory + chunk) = 0;
+    ASSERT_EQUAL(avm_pcall(S, reset, 1, arena), AVM_OK, "testArena (guest reset)");
+    ASSERT_EQUAL(a->chunks, 0, "testArena (guest reset chunks)");
+    avm_closearena(S, arena);
+    avm_close(S);
+}
+
+void testReallocCalloc() {
+    // realloc grows into a free neighbour without moving, shrinks in place
+    // and moves only when boxed in; calloc returns zeroed memory.
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    const char *code = "_main:\nbx lr\n";
+    avm_loadbuffer(S, code, strlen(code));
+    BYTE *a = my_malloc(S, 64);
+    BYTE *b = my_malloc(S, 64);
+    memset(a, 0x5A, 64);
+    my_free(S, b);
+    ASSERT_EQUAL(my_realloc(S, a, 1000) == a, 1, "testReallocCalloc (grow in place)");
+    ASSERT_EQUAL(a[63], 0x5A, "testReallocCalloc (contents)");
+    ASSERT_EQUAL(my_realloc(S, a, 32) == a, 1, "testReallocCalloc (shrink)");
+    BYTE *c = my_malloc(S, 64);
+    ASSERT_EQUAL(c == a + 48, 1, "testReallocCalloc (split tail reused)");
+    BYTE *moved = my_realloc(S, a, 4096);
+    ASSERT_EQUAL(moved != a && moved[31] == 0x5A, 1, "testReallocCalloc (moved)");
+
+    memset(c, 0xFF, 64);
+    my_free(S, c);
+    BYTE *z = my_calloc(S, 16, 4);
+    int zero = z != NULL;
+    for (int i = 0; z && i < 64; i++) zero &= z[i] == 0;
+    ASSERT_EQUAL(zero, 1, "testReallocCalloc (calloc reused)");
+    avm_close(S);
+
+    // A growable heap hands out fresh pages, which calloc leaves alone,
+    // and realloc of the last block extends the arena in place
+    S = avm_newstate(VM_STACK_SIZE, 4096);
+    avm_setlimits(S, VM_STACK_SIZE, 1 << 20);
+    avm_loadbuffer(S, code, strlen(code));
+    BYTE *last = my_malloc(S, 1024);
+    ASSERT_EQUAL(my_realloc(S, last, 256 * 1024) == last, 1, "testReallocCalloc (grow arena)");
+    my_free(S, last);
+    BYTE *big = my_calloc(S, 1, 512 * 1024);
+    zero = big != NULL;
+    for (int i = 0; big && i < 512 * 1024; i++) zero &= big[i] == 0;
+    ASSERT_EQUAL(zero, 1, "testReallocCalloc (calloc fresh)");
+    avm_close(S);
+}
+
+void testMemStats() {
+    // Heap counters follow malloc/free and the stack mark records the
+    // deepest push of a recursive guest function.
+    avm_State *S = avm_newstate(VM_STACK_SIZE, VM_HEAP_SIZE);
+    const char *code =
+        "_depth:\n"
+        "push {r4, lr}\n"
+        "subs r0, r0, #1\n"
+        "blne _depth\n"
+        "pop {r4, pc}\n"
+        ".globl _depth\n";
+    avm_loadbuffer(S, code, strlen(code));
+    avm_MemStats mem;
+    avm_memstats(S, &mem);
+    ASSERT_EQUAL(mem.freeblocks, 1, "testMemStats (fresh heap)");
+    ASSERT_EQUAL(mem.inuse, 0, "testMemStats (nothing in use)");
+    ASSERT_EQUAL(mem.largestfree, mem.free, "testMemStats (one free block)");
+
+    BYTE *a = my_malloc(S, 100);
+    BYTE *b = my_malloc(S, 200);
+    my_malloc(S, 300);
+    my_free(S, a);
+    my_free(S, a);
+    avm_memstats(S, &mem);
+    ASSERT_EQUAL(mem.allocs, 3, "testMemStats (allocs)");
+    ASSERT_EQUAL(mem.frees, 1, "testMemStats (frees)");
+    ASSERT_EQUAL(mem.inuse, 208 + 320, "testMemStats (in use)");
+    ASSERT_EQUAL(mem.freeblocks, 2, "testMemStats (fragmented)");
+    ASSERT_EQUAL(mem.inuse + mem.free, mem.heapsize, "testMemStats (accounted)");
+    my_free(S, b);
+    avm_memstats(S, &mem);
+    ASSERT_EQUAL(mem.freeblocks, 2, "testMemStats (merged)");
+
+    ASSERT_EQUAL(mem.stackused, 0, "testMemStats (stack unused)");
+    avm_pcall(S, avm_getfunction(S, "_depth"), 1, 10);
+    avm_memstats(S, &mem);
+    ASSERT_EQUAL(mem.stackused, 10 * 8, "testMemStats (stack depth)");
+    ASSERT_EQUAL(mem.stacklow, S->progsize + VM_STACK_SIZE - 80, "testMemStats (stack low)");
+    avm_close(S);
+}
+
 // Note: File-based tests from the original Objective-C test suite are commented out
 // because they require external assembly test files that don't exist in the repository:
 // - linked-list.s, linked-list2.s - Linked list traversal tests
@@ -259,6 +1574,32 @@ int main() {
     testADD();
     testPopPC();
     testFloatRoundtrip();
+    testDumpUndump();
+    testJournalReplay();
+    testJournalRing();
+    testInterrupt();
+    testYieldResume();
+    testRingSubmit();
+    testCallNested();
+    testPcall();
+    testCallBatch();
+    testTypedThunk();
+    testLateBinding();
+    testReload();
+    testThreads();
+    testFutex();
+    testFibers();
+    testChannels();
+    testMapBuffer();
+    testMapIO();
+    testPool();
+    testSharedRegistry();
+    testStats();
+    testHeapAllocator();
+    testGrowableHeap();
+    testArena();
+    testReallocCalloc();
+    testMemStats();
 
     // Print summary
     printf("\n=================\n");